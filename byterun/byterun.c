@@ -2,27 +2,105 @@
 
 # include <string.h>
 # include <stdio.h>
+# include <stddef.h>
 # include <errno.h>
 # include <malloc.h>
+# include <alloca.h>
+# include <fcntl.h>
+# include <sys/stat.h>
+# include <unistd.h>
 # include "../runtime/runtime.h"
+# include "../runtime/runtime_common.h"
+# include "../runtime/gc.h"
 
-void *__start_custom_data;
-void *__stop_custom_data;
+/* Lama globals of the bytecode live in the operand stack area (see below), the
+   section is only needed by the runtime to be present */
+size_t __custom_data_stub __attribute__ ((section ("custom_data"))) = 1;
+
+extern size_t __gc_stack_top, __gc_stack_bottom;
+
+extern int   LtagHash (char*);
+extern void* Bstring (void*);
+extern void* Belem (void*, int);
+extern void* Bsta (void*, int, void*);
+extern void* Bsti (void*, void**);
+extern int   Btag (void*, int, int);
+extern int   Barray_patt (void*, int);
+extern int   Bstring_patt (void*, void*);
+extern int   Bstring_tag_patt (void*);
+extern int   Barray_tag_patt (void*);
+extern int   Bsexp_tag_patt (void*);
+extern int   Bboxed_patt (void*);
+extern int   Bunboxed_patt (void*);
+extern int   Bclosure_tag_patt (void*);
+extern void  Bmatch_failure (void*, char*, int, int);
+extern int   Lread ();
+extern int   Lwrite (int);
+extern int   Llength (void*);
+extern void* Lstring (void*);
+
+/* Bytecode image format, version 2
+
+   A bytecode file is a position-independent image mapped into memory as is:
+
+     header   : "LAMA" version:32 globals:32 sections:32
+     sections : (kind:32 offset:32 size:32 checksum:32)*
+     ...      : section contents, each aligned to 4 bytes
+
+   Offsets are from the beginning of the file, checksums are 32-bit FNV-1a
+   hashes of section contents. Strings, publics and code are required and
+   checked on load; debug lines and imports are checked and parsed only when
+   asked for.
+*/
+
+# define IMAGE_MAGIC   "LAMA"
+# define IMAGE_VERSION 2
+
+enum {
+  SECTION_STRINGS = 1,           /* Zero-terminated strings                     */
+  SECTION_PUBLICS,               /* (name:32 offset:32)*                         */
+  SECTION_CODE,                  /* The bytecode                                 */
+  SECTION_LINES,                 /* (offset:32 line:32)*, ordered by offset      */
+  SECTION_IMPORTS                /* (name:32)*                                   */
+};
+
+typedef struct {
+  int      kind;
+  int      offset;
+  int      size;
+  unsigned checksum;
+} section;
+
+typedef struct {
+  char     magic[4];
+  int      version;
+  int      global_area_size;     /* The size (in words) of global area           */
+  int      sections_number;
+  section  sections[0];
+} image_header;
 
 /* The unpacked representation of bytecode file */
 typedef struct {
-  char *string_ptr;              /* A pointer to the beginning of the string table */
-  int  *public_ptr;              /* A pointer to the beginning of publics table    */
-  char *code_ptr;                /* A pointer to the bytecode itself               */
-  int  *global_ptr;              /* A pointer to the global area                   */
-  int   stringtab_size;          /* The size (in bytes) of the string table        */
-  int   global_area_size;        /* The size (in words) of global area             */
-  int   public_symbols_number;   /* The number of public symbols                   */
-  char  buffer[0];               
+  char         *fname;
+  char         *image;           /* The mapped file                                */
+  size_t        image_size;      /* The size (in bytes) of the mapped file         */
+  image_header *header;
+  char         *string_ptr;      /* A pointer to the beginning of the string table */
+  int          *public_ptr;      /* A pointer to the beginning of publics table    */
+  char         *code_ptr;        /* A pointer to the bytecode itself               */
+  int          *line_ptr;        /* Debug lines, 0 until loaded by get_lines       */
+  int           code_size;       /* The size (in bytes) of the bytecode            */
+  int           stringtab_size;  /* The size (in bytes) of the string table        */
+  int           global_area_size;/* The size (in words) of global area             */
+  int           public_symbols_number; /* The number of public symbols            */
+  int           lines_number;    /* The number of debug lines                      */
 } bytefile;
 
 /* Gets a string from a string table by an index */
 char* get_string (bytefile *f, int pos) {
+  if (pos < 0 || pos >= f->stringtab_size)
+    failure ("*** FAILURE: %s: string offset %d out of range\n", f->fname, pos);
+
   return &f->string_ptr[pos];
 }
 
@@ -36,39 +114,150 @@ int get_public_offset (bytefile *f, int i) {
   return f->public_ptr[i*2+1];
 }
 
-/* Reads a binary bytecode file by name and unpacks it */
-bytefile* read_file (char *fname) {
-  FILE *f = fopen (fname, "rb");
-  long size;
-  bytefile *file;
+/* Computes the 32-bit FNV-1a hash of a memory block */
+static unsigned fnv1a (char *p, int size) {
+  unsigned h = 2166136261u;
 
-  if (f == 0) {
-    failure ("%s\n", strerror (errno));
+  while (size--) {
+    h ^= (unsigned char) *p++;
+    h *= 16777619u;
   }
-  
-  if (fseek (f, 0, SEEK_END) == -1) {
+
+  return h;
+}
+
+/* Finds a section of a given kind and checks its contents; returns 0 for
+   a missing optional section */
+static section* get_section (bytefile *f, int kind, int required) {
+  int i;
+
+  for (i = 0; i < f->header->sections_number; i++) {
+    section *s = &f->header->sections[i];
+
+    if (s->kind != kind) continue;
+
+    if (fnv1a (f->image + s->offset, s->size) != s->checksum)
+      failure ("*** FAILURE: %s: checksum mismatch in section %d\n", f->fname, kind);
+
+    return s;
+  }
+
+  if (required) failure ("*** FAILURE: %s: no section %d\n", f->fname, kind);
+
+  return 0;
+}
+
+/* Gets the debug lines table, loading it on the first call */
+int* get_lines (bytefile *f) {
+  if (f->line_ptr == 0) {
+    section *s = get_section (f, SECTION_LINES, 0);
+
+    if (s == 0) return 0;
+
+    f->line_ptr     = (int*) (f->image + s->offset);
+    f->lines_number = s->size / (2 * sizeof (int));
+  }
+
+  return f->line_ptr;
+}
+
+/* Gets the source line of a bytecode offset, 0 if unknown */
+int get_line (bytefile *f, int offset) {
+  int *lines = get_lines (f), l = 0, r, line = 0;
+
+  if (lines == 0) return 0;
+
+  /* The last entry at or before the offset */
+  r = f->lines_number;
+  while (l < r) {
+    int m = (l + r) / 2;
+
+    if (lines[2*m] <= offset) {
+      line = lines[2*m+1];
+      l    = m + 1;
+    }
+    else r = m;
+  }
+
+  return line;
+}
+
+/* Reads a binary bytecode file by name and maps it */
+bytefile* read_file (char *fname) {
+  int          fd = open (fname, O_RDONLY), i;
+  struct stat  st;
+  bytefile    *file;
+  section     *s;
+
+  if (fd == -1 || fstat (fd, &st) == -1) {
     failure ("%s\n", strerror (errno));
   }
 
-  file = (bytefile*) malloc (sizeof(int)*4 + (size = ftell (f)));
+  file = (bytefile*) calloc (1, sizeof (bytefile));
 
   if (file == 0) {
     failure ("*** FAILURE: unable to allocate memory.\n");
   }
-  
-  rewind (f);
 
-  if (size != fread (&file->stringtab_size, 1, size, f)) {
+  file->fname      = fname;
+  file->image_size = st.st_size;
+  file->image      = (char*) mmap (0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (file->image == MAP_FAILED) {
     failure ("%s\n", strerror (errno));
   }
-  
-  fclose (f);
-  
-  file->string_ptr  = &file->buffer [file->public_symbols_number * 2 * sizeof(int)];
-  file->public_ptr  = (int*) file->buffer;
-  file->code_ptr    = &file->string_ptr [file->stringtab_size];
-  file->global_ptr  = (int*) malloc (file->global_area_size * sizeof (int));
-  
+
+  close (fd);
+
+  file->header = (image_header*) file->image;
+
+  if (file->image_size < sizeof (image_header)
+      || memcmp (file->header->magic, IMAGE_MAGIC, 4) != 0
+      || file->header->version != IMAGE_VERSION) {
+    failure ("*** FAILURE: %s: not a Lama bytecode file of version %d\n", fname, IMAGE_VERSION);
+  }
+
+  if (file->header->sections_number < 0
+      || file->header->sections_number > (file->image_size - sizeof (image_header)) / sizeof (section)
+      || file->header->global_area_size < 0) {
+    failure ("*** FAILURE: %s: malformed header\n", fname);
+  }
+
+  for (i = 0; i < file->header->sections_number; i++) {
+    s = &file->header->sections[i];
+
+    if (s->offset < 0 || s->size < 0 || s->offset % sizeof (int) != 0
+        || s->offset > file->image_size || s->size > file->image_size - s->offset) {
+      failure ("*** FAILURE: %s: malformed section %d\n", fname, i);
+    }
+  }
+
+  file->global_area_size = file->header->global_area_size;
+
+  s = get_section (file, SECTION_STRINGS, 1);
+  file->string_ptr     = file->image + s->offset;
+  file->stringtab_size = s->size;
+
+  if (s->size > 0 && file->string_ptr[s->size - 1] != 0) {
+    failure ("*** FAILURE: %s: unterminated string table\n", fname);
+  }
+
+  s = get_section (file, SECTION_PUBLICS, 1);
+  file->public_ptr            = (int*) (file->image + s->offset);
+  file->public_symbols_number = s->size / (2 * sizeof (int));
+
+  s = get_section (file, SECTION_CODE, 1);
+  file->code_ptr  = file->image + s->offset;
+  file->code_size = s->size;
+
+  for (i = 0; i < file->public_symbols_number; i++) {
+    get_public_name (file, i);
+
+    if (get_public_offset (file, i) < 0 || get_public_offset (file, i) >= file->code_size) {
+      failure ("*** FAILURE: %s: public symbol %d out of range\n", fname, i);
+    }
+  }
+
   return file;
 }
 
@@ -150,6 +339,10 @@ void disassemble (FILE *f, bytefile *bf) {
       case 11:
         fprintf (f, "ELEM");
         break;
+
+      case 12:
+        fprintf (f, "CSTRING\t%s", STRING);
+        break;
         
       default:
         FAIL;
@@ -267,6 +460,41 @@ void disassemble (FILE *f, bytefile *bf) {
       }
     }
     break;
+
+    /* Superinstructions */
+    case 8:
+      fprintf (f, "LD2BINOP\t%s\t", ops[l-1]);
+      for (int i = 0; i<2; i++) {
+        switch (BYTE) {
+        case 0: fprintf (f, "G(%d) ", INT); break;
+        case 1: fprintf (f, "L(%d) ", INT); break;
+        case 2: fprintf (f, "A(%d) ", INT); break;
+        case 3: fprintf (f, "C(%d) ", INT); break;
+        default: FAIL;
+        }
+      }
+      break;
+
+    case 9:
+      fprintf (f, "CBINOP\t%s\t%d", ops[l-1], INT);
+      break;
+
+    case 10:
+      switch (l) {
+      case 0:
+        fprintf (f, "DUPTAGCJMPnz\t%s ", STRING);
+        fprintf (f, "%d ", INT);
+        fprintf (f, "0x%.8x", INT);
+        break;
+
+      case 1:
+        fprintf (f, "DROPJMP\t0x%.8x", INT);
+        break;
+
+      default:
+        FAIL;
+      }
+      break;
       
     default:
       FAIL;
@@ -280,7 +508,8 @@ void disassemble (FILE *f, bytefile *bf) {
 
 /* Dumps the contents of the file */
 void dump_file (FILE *f, bytefile *bf) {
-  int i;
+  section *s;
+  int      i;
   
   fprintf (f, "String table size       : %d\n", bf->stringtab_size);
   fprintf (f, "Global area size        : %d\n", bf->global_area_size);
@@ -290,12 +519,1306 @@ void dump_file (FILE *f, bytefile *bf) {
   for (i=0; i < bf->public_symbols_number; i++) 
     fprintf (f, "   0x%.8x: %s\n", get_public_offset (bf, i), get_public_name (bf, i));
 
+  if ((s = get_section (bf, SECTION_IMPORTS, 0)) != 0) {
+    int *imports = (int*) (bf->image + s->offset);
+
+    fprintf (f, "Imports                 :\n");
+
+    for (i=0; i < s->size / sizeof (int); i++)
+      fprintf (f, "   %s\n", get_string (bf, imports[i]));
+  }
+
+  if (get_lines (bf) != 0)
+    fprintf (f, "Number of debug lines   : %d\n", bf->lines_number);
+
   fprintf (f, "Code:\n");
   disassemble (f, bf);
 }
 
+/* Threaded code interpreter
+
+   Before running, the bytecode is translated once into threaded code: each
+   instruction becomes a handler address (dispatched by computed goto)
+   followed by its operands in decoded form (jump targets as cell pointers,
+   frame offsets, addresses of globals, pre-boxed constants, pre-hashed tags).
+   Generic instructions are split into specialized handlers, so neither the
+   kind of a designation nor the binary operator is inspected at run time.
+
+   The operand stack lives in a region allocated on the machine stack by
+   "run" and grows down; the region is the GC root area [sp, __gc_stack_bottom),
+   so the runtime (linked from runtime.a) sees it exactly as it sees the
+   stack of a natively compiled program. Its upper part holds the preallocated
+   read-only string literals and the global area:
+
+     [ operand stack -->   | literals | globals ] <- __gc_stack_bottom
+
+   A frame of a called function looks like
+
+     closure      <- only for CALLC
+     arg 0
+     ...
+     arg n-1
+     return ip    <- fp[3]
+     closure      <- fp[2], BOX(0) for CALL
+     n (n+1)      <- fp[1], the number of words to drop on return
+     caller's fp  <- fp[0]
+     local 0      <- fp[-1]
+     ...
+     temporaries  <- sp
+*/
+
+# define OPERAND_STACK_SIZE (1 << 20)   /* The size (in words) of the root region */
+# define STACK_RESERVE      1024        /* Words reserved for the temporaries     */
+
+/* A cell of threaded code */
+typedef union cell {
+  void       *handler;            /* The address of an instruction handler     */
+  int         n;                  /* An integer operand                        */
+  char       *s;                  /* A string operand                          */
+  size_t     *p;                  /* The address of a global or a literal      */
+  union cell *target;             /* A jump target                             */
+  struct function *fn;            /* The function starting at a BEGIN          */
+} cell;
+
+/* Threaded code handlers; the order of BINOPs, designations and patterns
+   follows the bytecode encoding */
+enum {
+  I_ADD, I_SUB, I_MUL, I_DIV, I_MOD, I_LT, I_LE, I_GT, I_GE, I_EQ, I_NE, I_AND, I_OR,
+  I_CONST, I_STRING, I_LITERAL, I_SEXP, I_STI, I_STA, I_JMP, I_END, I_DROP, I_DUP, I_SWAP, I_ELEM,
+  I_LD_GLOBAL, I_LD_FRAME, I_LD_CLOSURE,
+  I_LDA_GLOBAL, I_LDA_FRAME, I_LDA_CLOSURE,
+  I_ST_GLOBAL, I_ST_FRAME, I_ST_CLOSURE,
+  I_CJMPZ, I_CJMPNZ, I_BEGIN, I_CLOSURE, I_CALLC, I_CALL, I_TAG, I_ARRAY, I_FAIL,
+  I_PATT_STR, I_PATT_STRING, I_PATT_ARRAY, I_PATT_SEXP, I_PATT_BOXED, I_PATT_UNBOXED, I_PATT_CLOSURE,
+  I_READ, I_WRITE, I_LENGTH, I_LSTRING, I_BARRAY, I_STOP,
+  I_ADD_LD2, I_SUB_LD2, I_MUL_LD2, I_DIV_LD2, I_MOD_LD2, I_LT_LD2, I_LE_LD2,
+  I_GT_LD2, I_GE_LD2, I_EQ_LD2, I_NE_LD2, I_AND_LD2, I_OR_LD2,
+  I_ADD_CONST, I_SUB_CONST, I_MUL_CONST, I_DIV_CONST, I_MOD_CONST, I_LT_CONST, I_LE_CONST,
+  I_GT_CONST, I_GE_CONST, I_EQ_CONST, I_NE_CONST, I_AND_CONST, I_OR_CONST,
+  I_DUP_TAG_CJMPNZ, I_DROP_JMP, I_LEAVE
+};
+
+/* Decoded designations: a global, a frame slot (local or argument) or a closure slot */
+enum { D_GLOBAL, D_FRAME, D_CLOSURE };
+
+/* Compiled code of a function: takes sp and fp after BEGIN, returns sp at END */
+typedef size_t* (*native) (size_t*, size_t*);
+
+/* A function of the program */
+typedef struct function {
+  cell     *begin;                /* Its BEGIN instruction                      */
+  int       calls;                /* The number of entries, -1 if not compilable */
+  native    code;                 /* Compiled code, 0 if not compiled (yet)     */
+} function;
+
+/* A translated program */
+typedef struct {
+  bytefile *bf;
+  char     *fname;                /* The name of the file for error messages    */
+  int      *position;             /* Threaded code positions of bytecode offsets */
+  cell     *code;                 /* Threaded code, 0 during the first pass     */
+  int       code_size;            /* The size (in cells) of the threaded code   */
+  int       entry;                /* The position of the code calling main      */
+  int       ret;                  /* The position of an END instruction         */
+  int       leave;                /* The position of the LEAVE instruction      */
+  size_t   *globals;              /* The global area                            */
+  size_t   *literals;             /* Preallocated read-only string literals     */
+  int       literals_number;      /* The number of literals                     */
+  size_t   *stack_limit;          /* The lowest address the stack may grow to   */
+} program;
+
+/* Creates the descriptor of a function starting at begin */
+static function* new_function (cell *begin) {
+  function *f = (function*) calloc (1, sizeof (function));
+
+  if (f == 0) failure ("*** FAILURE: unable to allocate memory.\n");
+
+  f->begin = begin;
+
+  return f;
+}
+
+/* Translates the bytecode into threaded code; during the first pass (p->code == 0)
+   only computes the positions of instructions, the size of the code and the
+   number of literals */
+static void translate (program *p, void **handlers) {
+  bytefile *bf       = p->bf;
+  char     *ip       = bf->code_ptr;
+  int       n        = 0,
+            literals = 0,
+            nargs    = 0,
+            i;
+
+# define EMIT(field, v) do { if (p->code) p->code[n].field = (v); n++; } while (0)
+# define OP(i)          EMIT (handler, handlers[i])
+# define TARGET(l)      EMIT (target, p->code ? p->code + p->position[l] : 0)
+
+  /* Decodes the operand of a designation m (G, L, A or C) with index a: the
+     address of a global, an offset from fp or a word index in the closure */
+# define DESIGNATION(m, a)                                                  \
+  do {                                                                      \
+    if (m == 0) EMIT (p, &p->globals[a]);                                   \
+    else EMIT (n, m == 1 ? -1 - (a) : m == 2 ? 4 + nargs - 1 - (a) : (a) + 1); \
+  } while (0)
+
+# define KIND(m) ((m) == 0 ? D_GLOBAL : (m) == 3 ? D_CLOSURE : D_FRAME)
+
+  while (ip < bf->code_ptr + bf->code_size) {
+    char x = BYTE,
+         h = (x & 0xF0) >> 4,
+         l = x & 0x0F;
+    int  a, b;
+
+    p->position[ip - bf->code_ptr - 1] = n;
+
+    switch (h) {
+    case 15:
+      OP (I_STOP);
+      break;
+
+    case 0:
+      if (l < 1 || l > 13) FAIL;
+      OP (I_ADD + l - 1);
+      break;
+
+    case 1:
+      switch (l) {
+      case  0: a = INT; OP (I_CONST); EMIT (n, BOX (a)); break;
+      case  1: a = INT; OP (I_STRING); EMIT (s, get_string (bf, a)); break;
+
+      case  2:
+        a = INT;
+        b = INT;
+        OP (I_SEXP);
+        EMIT (n, p->code ? UNBOX (LtagHash (get_string (bf, a))) : 0);
+        EMIT (n, b);
+        break;
+
+      case  3: OP (I_STI); break;
+      case  4: OP (I_STA); break;
+      case  5: a = INT; OP (I_JMP); TARGET (a); break;
+      case  6:
+      case  7: OP (I_END); break;
+      case  8: OP (I_DROP); break;
+      case  9: OP (I_DUP); break;
+      case 10: OP (I_SWAP); break;
+      case 11: OP (I_ELEM); break;
+
+      case 12:
+        a = INT;
+        if (p->code) {
+          __gc_stack_top = (size_t) p->literals - sizeof (size_t);
+          p->literals[literals] = (size_t) Bstring (get_string (bf, a));
+        }
+        OP (I_LITERAL);
+        EMIT (p, &p->literals[literals++]);
+        break;
+
+      default:
+        FAIL;
+      }
+      break;
+
+    case 2:
+    case 3:
+    case 4:
+      if (l > 3) FAIL;
+      a = INT;
+      OP ((h == 2 ? I_LD_GLOBAL : h == 3 ? I_LDA_GLOBAL : I_ST_GLOBAL) + KIND (l));
+      DESIGNATION (l, a);
+      break;
+
+    case 5:
+      switch (l) {
+      case  0: a = INT; OP (I_CJMPZ); TARGET (a); break;
+      case  1: a = INT; OP (I_CJMPNZ); TARGET (a); break;
+
+      case  2:
+      case  3:
+        nargs = INT;
+        a     = INT;
+        OP (I_BEGIN);
+        EMIT (n, a);
+        EMIT (fn, p->code ? new_function (p->code + n - 2) : 0);
+        break;
+
+      case  4:
+        a = INT;
+        b = INT;
+        OP (I_CLOSURE);
+        TARGET (a);
+        EMIT (n, b);
+        for (i = 0; i < b; i++) {
+          char m = BYTE;
+          if (m < 0 || m > 3) FAIL;
+          a = INT;
+          EMIT (n, KIND (m));
+          DESIGNATION (m, a);
+        }
+        break;
+
+      case  5:
+        a = INT;
+        OP (I_CALLC);
+        EMIT (n, a);
+        EMIT (target, 0);   /* the inline cache of the JIT: the last entry called */
+        EMIT (fn, 0);       /* ... and its function                               */
+        break;
+
+      case  6: a = INT; b = INT; OP (I_CALL); TARGET (a); EMIT (n, b); break;
+
+      case  7:
+        a = INT;
+        b = INT;
+        OP (I_TAG);
+        EMIT (n, p->code ? LtagHash (get_string (bf, a)) : 0);
+        EMIT (n, BOX (b));
+        break;
+
+      case  8: a = INT; OP (I_ARRAY); EMIT (n, BOX (a)); break;
+      case  9: a = INT; b = INT; OP (I_FAIL); EMIT (n, BOX (a)); EMIT (n, BOX (b)); break;
+      case 10: a = INT; break;
+
+      default:
+        FAIL;
+      }
+      break;
+
+    case 6:
+      if (l > 6) FAIL;
+      OP (I_PATT_STR + l);
+      break;
+
+    case 8:
+      if (l < 1 || l > 13) FAIL;
+      OP (I_ADD_LD2 + l - 1);
+      for (i = 0; i < 2; i++) {
+        char m = BYTE;
+        if (m < 0 || m > 3) FAIL;
+        a = INT;
+        EMIT (n, KIND (m));
+        DESIGNATION (m, a);
+      }
+      break;
+
+    case 9:
+      if (l < 1 || l > 13) FAIL;
+      a = INT;
+      OP (I_ADD_CONST + l - 1);
+      EMIT (n, BOX (a));
+      break;
+
+    case 10:
+      switch (l) {
+      case 0:
+        a = INT;
+        b = INT;
+        OP (I_DUP_TAG_CJMPNZ);
+        EMIT (n, p->code ? LtagHash (get_string (bf, a)) : 0);
+        EMIT (n, BOX (b));
+        a = INT;
+        TARGET (a);
+        break;
+
+      case 1: a = INT; OP (I_DROP_JMP); TARGET (a); break;
+      default: FAIL;
+      }
+      break;
+
+    case 7:
+      switch (l) {
+      case 0: OP (I_READ); break;
+      case 1: OP (I_WRITE); break;
+      case 2: OP (I_LENGTH); break;
+      case 3: OP (I_LSTRING); break;
+      case 4: a = INT; OP (I_BARRAY); EMIT (n, a); break;
+      default: FAIL;
+      }
+      break;
+
+    default:
+      FAIL;
+    }
+  }
+
+  /* The bootstrap code: calls main with two dummy arguments pushed by "run" */
+  for (i = 0; i < bf->public_symbols_number; i++)
+    if (strcmp (get_public_name (bf, i), "main") == 0) break;
+
+  if (i == bf->public_symbols_number) failure ("*** FAILURE: no main function in %s\n", p->fname);
+
+  p->entry = n;
+  OP (I_CALL);
+  TARGET (get_public_offset (bf, i));
+  EMIT (n, 2);
+  OP (I_STOP);
+
+  /* An END to finish natively run functions and the return point of the calls
+     from native code back to the interpreter */
+  p->ret = n;
+  OP (I_END);
+  p->leave = n;
+  OP (I_LEAVE);
+
+  p->code_size       = n;
+  p->literals_number = literals;
+
+# undef EMIT
+# undef OP
+# undef TARGET
+# undef DESIGNATION
+# undef KIND
+}
+
+# define PUSH(v) (*--sp = (size_t) (v))
+# define POP      (*sp++)
+# define TOP      sp[0]
+
+/* Publishes the operand stack to the GC before calling an allocating primitive */
+# define SYNC     (__gc_stack_top = (size_t) sp - sizeof (size_t))
+
+/* Loads a decoded designation of kind k with operand op */
+# define LOAD(k, op) ((k) == D_GLOBAL ? *(op).p : (k) == D_FRAME ? fp[(op).n] : ((size_t*) fp[2])[(op).n])
+
+static void  **handler_table;     /* Set by the first call of interpret         */
+static program *jit_program;      /* The program being run, for the helpers    */
+
+static size_t* interpret (program *p, cell *ip, size_t *sp, size_t *fp);
+
+/* Pushes l locals of a function being entered */
+static size_t* alloc_locals (program *p, size_t *sp, int l) {
+  if (sp - l - STACK_RESERVE < p->stack_limit) failure ("*** FAILURE: stack overflow\n");
+
+  while (l--) PUSH (BOX (0));
+
+  return sp;
+}
+
+/* Template JIT
+
+   A function whose BEGIN has run jit_threshold times is compiled to native
+   x86 code by stitching together a machine code template per threaded code
+   instruction. Compiled code keeps sp in %esi and fp in %edi and uses the same
+   operand stack, frames and GC root discipline as the interpreter. Constants,
+   designations, stack shuffling, jumps, integer arithmetic, comparisons and
+   tag tests (TAG and PATT) are inlined; the rest calls a helper
+
+     size_t* helper (size_t *sp, size_t *fp, <operand>)
+
+   which returns the new sp. Calls go through jit_enter, which runs the callee
+   natively if it is compiled and in the interpreter otherwise.
+
+   The threshold can be set by LAMA_JIT_THRESHOLD (e.g. 1 to compile every
+   function on its first call). If LAMA_JIT_STRICT is set, a function the JIT
+   cannot compile is a fatal error instead of staying in the interpreter.
+*/
+
+# define JIT_THRESHOLD 100   /* The number of calls after which a function is compiled  */
+# define JIT_TEMPLATE  64    /* An upper bound for the size (in bytes) of a template    */
+
+static int jit_threshold = JIT_THRESHOLD;   /* Overridden by LAMA_JIT_THRESHOLD */
+static int jit_strict    = 0;               /* Set by LAMA_JIT_STRICT           */
+
+/* Enters function f from compiled code */
+static size_t* jit_enter (function *f, size_t *sp, size_t *fp, size_t closure, int drop) {
+  size_t r;
+
+  PUSH (jit_program->code + jit_program->leave);
+  PUSH (closure);
+  PUSH (drop);
+  PUSH (fp);
+  fp = sp;
+
+  if (f->code == 0) return interpret (jit_program, f->begin, sp, fp);
+
+  sp = f->code (alloc_locals (jit_program, sp, f->begin[1].n), fp);
+  r  = TOP;
+  sp = fp + 4 + drop;
+  PUSH (r);
+
+  return sp;
+}
+
+/* Helpers called from compiled code */
+static size_t* jit_binop (size_t *sp, size_t *fp, int op) {
+  int y = POP, x = TOP;
+
+  switch (op) {
+  case I_MUL: TOP = BOX (UNBOX (x) * UNBOX (y)); break;
+  case I_DIV: TOP = BOX (UNBOX (x) / UNBOX (y)); break;
+  case I_MOD: TOP = BOX (UNBOX (x) % UNBOX (y)); break;
+  case I_AND: TOP = BOX (UNBOX (x) && UNBOX (y)); break;
+  case I_OR:  TOP = BOX (UNBOX (x) || UNBOX (y)); break;
+  default:    failure ("*** FAILURE: unexpected binary operator %d\n", op);
+  }
+
+  return sp;
+}
+
+static size_t* jit_string (size_t *sp, size_t *fp, cell *ip) {
+  void *r;
+
+  SYNC;
+  r = Bstring (ip->s);
+  PUSH (r);
+
+  return sp;
+}
+
+static size_t* jit_sexp (size_t *sp, size_t *fp, cell *ip) {
+  int   n = ip[1].n, i;
+  sexp *r;
+
+  SYNC;
+  r      = (sexp*) alloc_sexp (n);
+  r->tag = ip[0].n;
+  for (i = 0; i < n; i++) r->contents[i] = sp[n-1-i];
+  sp += n;
+  PUSH (((data*) r)->contents);
+
+  return sp;
+}
+
+static size_t* jit_sti (size_t *sp, size_t *fp, cell *ip) {
+  size_t v = POP, x = TOP;
+
+  TOP = (size_t) Bsti ((void*) v, (void**) x);
+
+  return sp;
+}
+
+static size_t* jit_sta (size_t *sp, size_t *fp, cell *ip) {
+  size_t v = POP, i = POP;
+
+  if (UNBOXED (i)) TOP = (size_t) Bsta ((void*) v, i, (void*) TOP);
+  else PUSH (Bsti ((void*) v, (void**) i));
+
+  return sp;
+}
+
+static size_t* jit_elem (size_t *sp, size_t *fp, cell *ip) {
+  size_t i = POP;
+
+  TOP = (size_t) Belem ((void*) TOP, i);
+
+  return sp;
+}
+
+static size_t* jit_st_closure (size_t *sp, size_t *fp, cell *ip) {
+  size_t *slot = (size_t*) fp[2] + ip->n;
+
+  *slot = TOP;
+  gc_write_barrier ((void**) slot, (void*) TOP);
+
+  return sp;
+}
+
+static size_t* jit_closure (size_t *sp, size_t *fp, cell *ip) {
+  cell *d = ip + 2;
+  int   n = ip[1].n, i;
+  data *r;
+
+  SYNC;
+  r = (data*) alloc_closure (n + 1);
+  ((size_t*) r->contents)[0] = (size_t) ip[0].target;
+  for (i = 0; i < n; i++) ((size_t*) r->contents)[i+1] = LOAD (d[2*i].n, d[2*i+1]);
+  PUSH (r->contents);
+
+  return sp;
+}
+
+static size_t* jit_call (size_t *sp, size_t *fp, cell *ip) {
+  return jit_enter (ip[0].target[2].fn, sp, fp, BOX (0), ip[1].n);
+}
+
+static size_t* jit_callc (size_t *sp, size_t *fp, cell *ip) {
+  int    n     = ip[0].n;
+  size_t c     = sp[n];
+  cell  *entry = *(cell**) c;
+
+  /* A monomorphic inline cache: the entry of the closure called last and its function */
+  if (ip[1].target != entry) {
+    ip[1].target = entry;
+    ip[2].fn     = entry[2].fn;
+  }
+
+  return jit_enter (ip[2].fn, sp, fp, c, n + 1);
+}
+
+static size_t* jit_array (size_t *sp, size_t *fp, cell *ip) {
+  TOP = Barray_patt ((void*) TOP, ip->n);
+
+  return sp;
+}
+
+static size_t* jit_fail (size_t *sp, size_t *fp, cell *ip) {
+  SYNC;
+  Bmatch_failure ((void*) TOP, jit_program->fname, ip[0].n, ip[1].n);
+
+  return sp;
+}
+
+static size_t* jit_patt_str (size_t *sp, size_t *fp, cell *ip) {
+  size_t y = POP;
+
+  TOP = Bstring_patt ((void*) TOP, (void*) y);
+
+  return sp;
+}
+
+static size_t* jit_read (size_t *sp, size_t *fp, cell *ip) {
+  PUSH (Lread ());
+
+  return sp;
+}
+
+static size_t* jit_write (size_t *sp, size_t *fp, cell *ip) {
+  TOP = Lwrite (TOP);
+
+  return sp;
+}
+
+static size_t* jit_length (size_t *sp, size_t *fp, cell *ip) {
+  TOP = Llength ((void*) TOP);
+
+  return sp;
+}
+
+static size_t* jit_lstring (size_t *sp, size_t *fp, cell *ip) {
+  void *r;
+
+  SYNC;
+  r   = Lstring ((void*) TOP);
+  TOP = (size_t) r;
+
+  return sp;
+}
+
+static size_t* jit_barray (size_t *sp, size_t *fp, cell *ip) {
+  int   n = ip->n, i;
+  data *r;
+
+  SYNC;
+  r = (data*) alloc_array (n);
+  for (i = 0; i < n; i++) ((size_t*) r->contents)[i] = sp[n-1-i];
+  sp += n;
+  PUSH (r->contents);
+
+  return sp;
+}
+
+/* The number of cells of each threaded code instruction (CLOSURE has
+   two more per captured value) */
+static const char instruction_cells [] = {
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  2, 2, 2, 3, 1, 1, 2, 1, 1, 1, 1, 1,
+  2, 2, 2,
+  2, 2, 2,
+  2, 2, 2,
+  2, 2, 3, 3, 4, 3, 3, 2, 3,
+  1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 2, 1,
+  5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+  4, 2, 1
+};
+
+/* Gets the handler number of a threaded code instruction */
+static int opcode_of (cell *c) {
+  int i;
+
+  for (i = 0; i <= I_LEAVE; i++)
+    if (handler_table[i] == c->handler) return i;
+
+  failure ("*** FAILURE: invalid threaded code\n");
+  return -1;
+}
+
+/* Gets the next instruction */
+static cell* next_instruction (cell *c) {
+  int op = opcode_of (c);
+
+  return c + instruction_cells[op] + (op == I_CLOSURE ? 2 * c[2].n : 0);
+}
+
+/* A jump to patch once all the templates are placed */
+typedef struct {
+  unsigned char *at;              /* The rel32 field                            */
+  cell          *target;          /* The target instruction                     */
+} jump;
+
+static unsigned char *jit_pc;     /* The current position in the code buffer    */
+
+# define B(x) (*jit_pc++ = (unsigned char) (x))
+
+static void emit_int (int x) {
+  memcpy (jit_pc, &x, sizeof (int));
+  jit_pc += sizeof (int);
+}
+
+/* sub $4, %esi; mov %eax, (%esi) */
+static void emit_push (void) {
+  B (0x83); B (0xee); B (0x04);
+  B (0x89); B (0x06);
+}
+
+/* mov (%esi), %eax; add $4, %esi */
+static void emit_pop (void) {
+  B (0x8b); B (0x06);
+  B (0x83); B (0xc6); B (0x04);
+}
+
+/* sub $4, %esi; movl $x, (%esi) */
+static void emit_const (int x) {
+  B (0x83); B (0xee); B (0x04);
+  B (0xc7); B (0x06); emit_int (x);
+}
+
+/* Loads a designation into %eax */
+static void emit_load (int k, cell op) {
+  switch (k) {
+  case D_GLOBAL:                                     /* mov addr, %eax     */
+    B (0xa1); emit_int ((int) op.p);
+    break;
+
+  case D_FRAME:                                      /* mov n(%edi), %eax  */
+    B (0x8b); B (0x87); emit_int (op.n * sizeof (size_t));
+    break;
+
+  case D_CLOSURE:                                    /* mov 8(%edi), %eax  */
+    B (0x8b); B (0x47); B (0x08);                    /* mov n(%eax), %eax  */
+    B (0x8b); B (0x80); emit_int (op.n * sizeof (size_t));
+    break;
+  }
+}
+
+/* Calls a helper with sp, fp and arg, keeping %esp 16-byte aligned */
+static void emit_helper (void *helper, size_t arg) {
+  B (0x83); B (0xec); B (0x04);                      /* sub $4, %esp       */
+  B (0x68); emit_int (arg);                          /* push $arg          */
+  B (0x57);                                          /* push %edi          */
+  B (0x56);                                          /* push %esi          */
+  B (0xe8); emit_int ((unsigned char*) helper - (jit_pc + sizeof (int)));
+  B (0x83); B (0xc4); B (0x10);                      /* add $16, %esp      */
+  B (0x89); B (0xc6);                                /* mov %eax, %esi     */
+}
+
+/* Binary operator number op (counting from I_ADD) on the two topmost words */
+static void emit_binop (int op) {
+  static const unsigned char setcc [] = {0x9c, 0x9e, 0x9f, 0x9d, 0x94, 0x95};
+
+  switch (I_ADD + op) {
+  case I_ADD:
+    emit_pop ();
+    B (0x01); B (0x06);                              /* add %eax, (%esi)   */
+    B (0xff); B (0x0e);                              /* decl (%esi)        */
+    break;
+
+  case I_SUB:
+    emit_pop ();
+    B (0x29); B (0x06);                              /* sub %eax, (%esi)   */
+    B (0xff); B (0x06);                              /* incl (%esi)        */
+    break;
+
+  case I_LT: case I_LE: case I_GT: case I_GE: case I_EQ: case I_NE:
+    emit_pop ();
+    B (0x39); B (0x06);                              /* cmp %eax, (%esi)   */
+    B (0x0f); B (setcc[op - (I_LT - I_ADD)]); B (0xc0); /* setcc %al       */
+    B (0x0f); B (0xb6); B (0xc0);                    /* movzbl %al, %eax   */
+    B (0x8d); B (0x44); B (0x00); B (0x01);          /* lea 1(%eax,%eax), %eax */
+    B (0x89); B (0x06);                              /* mov %eax, (%esi)   */
+    break;
+
+  default:
+    emit_helper (jit_binop, I_ADD + op);
+  }
+}
+
+/* Compares the sexp in %eax against a boxed tag hash t and boxed arity n,
+   jumping rel8 bytes forward on a mismatch, and reaches the final
+   "cmpl $tag, (%eax)" whose flags are left to the caller */
+static void emit_sexp_test (int t, int n, int rel8) {
+  B (0xa8); B (0x01);                                /* test $1, %al       */
+  B (0x75); B (rel8 + 15);                           /* jnz  mismatch      */
+  B (0x81); B (0x78); B (-(int) DATA_HEADER_SZ);     /* cmpl $header, -H(%eax) */
+  emit_int (SEXP_TAG | (UNBOX (n) << 3));
+  B (0x75); B (rel8 + 6);                            /* jne  mismatch      */
+  B (0x81); B (0x38); emit_int (UNBOX (t));          /* cmpl $tag, (%eax)  */
+}
+
+/* Tests the kind of the data on the top of the stack, leaving a boxed boolean */
+static void emit_kind_test (int tag) {
+  B (0x8b); B (0x06);                                /* mov (%esi), %eax   */
+  B (0xc7); B (0x06); emit_int (BOX (0));            /* movl $BOX(0), (%esi) */
+  B (0xa8); B (0x01);                                /* test $1, %al       */
+  B (0x75); B (0x11);                                /* jnz  done          */
+  B (0x8b); B (0x40); B (-(int) DATA_HEADER_SZ);     /* mov -H(%eax), %eax */
+  B (0x83); B (0xe0); B (0x07);                      /* and $7, %eax       */
+  B (0x83); B (0xf8); B (tag);                       /* cmp $tag, %eax     */
+  B (0x75); B (0x06);                                /* jne  done          */
+  B (0xc7); B (0x06); emit_int (BOX (1));            /* movl $BOX(1), (%esi) */
+}                                                    /* done:              */
+
+/* Compiles function f; on failure leaves it to the interpreter for good */
+static void jit_compile (program *p, function *f) {
+  cell           *begin = f->begin + instruction_cells[I_BEGIN], *end, *c;
+  unsigned char  *code, **addr;
+  jump           *jumps;
+  int             count = 0, njumps = 0, size, op, i;
+
+# define JUMP(t) do { jumps[njumps].at = jit_pc; jumps[njumps++].target = (t); emit_int (0); } while (0)
+
+  f->calls = -1;
+
+  for (end = begin; end < p->code + p->entry; end = next_instruction (end)) {
+    op = opcode_of (end);
+    if (op == I_BEGIN || op == I_STOP) break;
+    count++;
+  }
+
+  size = JIT_TEMPLATE * (count + 1);
+  code = mmap (0, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (code == MAP_FAILED) return;
+
+  addr  = (unsigned char**) calloc (end - begin, sizeof (unsigned char*));
+  jumps = (jump*) malloc ((count + 1) * sizeof (jump));
+
+  if (addr == 0 || jumps == 0) failure ("*** FAILURE: unable to allocate memory.\n");
+
+  jit_pc = code;
+
+  B (0x55);                                          /* push %ebp          */
+  B (0x89); B (0xe5);                                /* mov %esp, %ebp     */
+  B (0x56);                                          /* push %esi          */
+  B (0x57);                                          /* push %edi          */
+  B (0x8b); B (0x75); B (0x08);                      /* mov 8(%ebp), %esi  */
+  B (0x8b); B (0x7d); B (0x0c);                      /* mov 12(%ebp), %edi */
+
+  for (c = begin; c < end; c = next_instruction (c)) {
+    addr[c - begin] = jit_pc;
+
+    switch (op = opcode_of (c)) {
+    case I_ADD: case I_SUB: case I_MUL: case I_DIV: case I_MOD: case I_LT: case I_LE:
+    case I_GT:  case I_GE:  case I_EQ:  case I_NE:  case I_AND: case I_OR:
+      emit_binop (op - I_ADD);
+      break;
+
+    case I_ADD_LD2: case I_SUB_LD2: case I_MUL_LD2: case I_DIV_LD2: case I_MOD_LD2:
+    case I_LT_LD2:  case I_LE_LD2:  case I_GT_LD2:  case I_GE_LD2:  case I_EQ_LD2:
+    case I_NE_LD2:  case I_AND_LD2: case I_OR_LD2:
+      emit_load (c[1].n, c[2]);
+      emit_push ();
+      emit_load (c[3].n, c[4]);
+      emit_push ();
+      emit_binop (op - I_ADD_LD2);
+      break;
+
+    case I_ADD_CONST: case I_SUB_CONST: case I_MUL_CONST: case I_DIV_CONST: case I_MOD_CONST:
+    case I_LT_CONST:  case I_LE_CONST:  case I_GT_CONST:  case I_GE_CONST:  case I_EQ_CONST:
+    case I_NE_CONST:  case I_AND_CONST: case I_OR_CONST:
+      emit_const (c[1].n);
+      emit_binop (op - I_ADD_CONST);
+      break;
+
+    case I_CONST:
+      emit_const (c[1].n);
+      break;
+
+    case I_LITERAL:
+    case I_LD_GLOBAL:
+    case I_LD_FRAME:
+    case I_LD_CLOSURE:
+      emit_load (op == I_LITERAL ? D_GLOBAL : op - I_LD_GLOBAL, c[1]);
+      emit_push ();
+      break;
+
+    case I_LDA_GLOBAL:                               /* mov $addr, %eax    */
+      B (0xb8); emit_int ((int) c[1].p);
+      emit_push ();
+      break;
+
+    case I_LDA_FRAME:                                /* lea n(%edi), %eax  */
+      B (0x8d); B (0x87); emit_int (c[1].n * sizeof (size_t));
+      emit_push ();
+      break;
+
+    case I_LDA_CLOSURE:
+      B (0x8b); B (0x47); B (0x08);                  /* mov 8(%edi), %eax  */
+      B (0x05); emit_int (c[1].n * sizeof (size_t)); /* add $n, %eax       */
+      emit_push ();
+      break;
+
+    case I_ST_GLOBAL:
+      B (0x8b); B (0x06);                            /* mov (%esi), %eax   */
+      B (0xa3); emit_int ((int) c[1].p);             /* mov %eax, addr     */
+      break;
+
+    case I_ST_FRAME:
+      B (0x8b); B (0x06);                            /* mov (%esi), %eax   */
+      B (0x89); B (0x87); emit_int (c[1].n * sizeof (size_t)); /* mov %eax, n(%edi) */
+      break;
+
+    case I_DUP:
+      B (0x8b); B (0x06);                            /* mov (%esi), %eax   */
+      emit_push ();
+      break;
+
+    case I_DROP:
+      B (0x83); B (0xc6); B (0x04);                  /* add $4, %esi       */
+      break;
+
+    case I_SWAP:
+      B (0x8b); B (0x06);                            /* mov (%esi), %eax   */
+      B (0x8b); B (0x56); B (0x04);                  /* mov 4(%esi), %edx  */
+      B (0x89); B (0x16);                            /* mov %edx, (%esi)   */
+      B (0x89); B (0x46); B (0x04);                  /* mov %eax, 4(%esi)  */
+      break;
+
+    case I_DROP_JMP:
+      B (0x83); B (0xc6); B (0x04);                  /* add $4, %esi       */
+      /* fall through */
+
+    case I_JMP:
+      B (0xe9); JUMP (c[1].target);                  /* jmp target         */
+      break;
+
+    case I_CJMPZ:
+    case I_CJMPNZ:
+      emit_pop ();
+      B (0xd1); B (0xf8);                            /* sar %eax           */
+      B (0x85); B (0xc0);                            /* test %eax, %eax    */
+      B (0x0f); B (op == I_CJMPZ ? 0x84 : 0x85);     /* jz/jnz target      */
+      JUMP (c[1].target);
+      break;
+
+    case I_END:
+      B (0x89); B (0xf0);                            /* mov %esi, %eax     */
+      B (0x5f);                                      /* pop %edi           */
+      B (0x5e);                                      /* pop %esi           */
+      B (0x5d);                                      /* pop %ebp           */
+      B (0xc3);                                      /* ret                */
+      break;
+
+    case I_TAG:
+      B (0x8b); B (0x06);                            /* mov (%esi), %eax   */
+      B (0xc7); B (0x06); emit_int (BOX (0));        /* movl $BOX(0), (%esi) */
+      emit_sexp_test (c[1].n, c[2].n, 8);
+      B (0x75); B (0x06);                            /* jne  done          */
+      B (0xc7); B (0x06); emit_int (BOX (1));        /* movl $BOX(1), (%esi) */
+      break;                                         /* done:              */
+
+    case I_DUP_TAG_CJMPNZ:
+      B (0x8b); B (0x06);                            /* mov (%esi), %eax   */
+      emit_sexp_test (c[1].n, c[2].n, 6);
+      B (0x0f); B (0x84); JUMP (c[3].target);        /* je   target        */
+      break;
+
+    case I_PATT_STRING:  emit_kind_test (STRING_TAG);  break;
+    case I_PATT_ARRAY:   emit_kind_test (ARRAY_TAG);   break;
+    case I_PATT_SEXP:    emit_kind_test (SEXP_TAG);    break;
+    case I_PATT_CLOSURE: emit_kind_test (CLOSURE_TAG); break;
+
+    case I_PATT_BOXED:
+    case I_PATT_UNBOXED:
+      B (0x8b); B (0x06);                            /* mov (%esi), %eax   */
+      B (0x83); B (0xe0); B (0x01);                  /* and $1, %eax       */
+      if (op == I_PATT_BOXED) {
+        B (0x83); B (0xf0); B (0x01);                /* xor $1, %eax       */
+      }
+      B (0x8d); B (0x44); B (0x00); B (0x01);        /* lea 1(%eax,%eax), %eax */
+      B (0x89); B (0x06);                            /* mov %eax, (%esi)   */
+      break;
+
+    case I_STRING:     emit_helper (jit_string,     (size_t) (c + 1)); break;
+    case I_SEXP:       emit_helper (jit_sexp,       (size_t) (c + 1)); break;
+    case I_STI:        emit_helper (jit_sti,        0);                break;
+    case I_STA:        emit_helper (jit_sta,        0);                break;
+    case I_ELEM:       emit_helper (jit_elem,       0);                break;
+    case I_ST_CLOSURE: emit_helper (jit_st_closure, (size_t) (c + 1)); break;
+    case I_CLOSURE:    emit_helper (jit_closure,    (size_t) (c + 1)); break;
+    case I_CALLC:      emit_helper (jit_callc,      (size_t) (c + 1)); break;
+    case I_CALL:       emit_helper (jit_call,       (size_t) (c + 1)); break;
+    case I_ARRAY:      emit_helper (jit_array,      (size_t) (c + 1)); break;
+    case I_FAIL:       emit_helper (jit_fail,       (size_t) (c + 1)); break;
+    case I_PATT_STR:   emit_helper (jit_patt_str,   0);                break;
+    case I_READ:       emit_helper (jit_read,       0);                break;
+    case I_WRITE:      emit_helper (jit_write,      0);                break;
+    case I_LENGTH:     emit_helper (jit_length,     0);                break;
+    case I_LSTRING:    emit_helper (jit_lstring,    0);                break;
+    case I_BARRAY:     emit_helper (jit_barray,     (size_t) (c + 1)); break;
+
+    default:
+      goto fail;
+    }
+  }
+
+  for (i = 0; i < njumps; i++) {
+    cell *t = jumps[i].target;
+    int   rel;
+
+    if (t < begin || t >= end || addr[t - begin] == 0) goto fail;
+
+    rel = addr[t - begin] - (jumps[i].at + sizeof (int));
+    memcpy (jumps[i].at, &rel, sizeof (int));
+  }
+
+  f->code = (native) code;
+  free (addr);
+  free (jumps);
+  return;
+
+ fail:
+  munmap (code, size);
+  free (addr);
+  free (jumps);
+
+  if (jit_strict) failure ("*** FAILURE: the JIT cannot compile the function at %d.\n", (int) (f->begin - p->code));
+
+# undef JUMP
+}
+
+# undef B
+
+/* Runs threaded code from ip with the operand stack at sp and the frame at fp
+   until STOP or LEAVE, returns the final sp; when called with ip == 0 only
+   sets handler_table */
+static size_t* interpret (program *p, cell *ip, size_t *sp, size_t *fp) {
+  static void *handlers [] = {
+    &&add, &&sub, &&mul, &&div, &&mod, &&lt, &&le, &&gt, &&ge, &&eq, &&ne, &&and, &&or,
+    &&const_, &&string, &&literal, &&sexp_, &&sti, &&sta, &&jmp, &&end, &&drop, &&dup, &&swap, &&elem,
+    &&ld_global, &&ld_frame, &&ld_closure,
+    &&lda_global, &&lda_frame, &&lda_closure,
+    &&st_global, &&st_frame, &&st_closure,
+    &&cjmpz, &&cjmpnz, &&begin, &&closure, &&callc, &&call, &&tag, &&array, &&fail,
+    &&patt_str, &&patt_string, &&patt_array, &&patt_sexp, &&patt_boxed, &&patt_unboxed, &&patt_closure,
+    &&read, &&write, &&length, &&lstring, &&barray, &&stop,
+    &&add_ld2, &&sub_ld2, &&mul_ld2, &&div_ld2, &&mod_ld2, &&lt_ld2, &&le_ld2,
+    &&gt_ld2, &&ge_ld2, &&eq_ld2, &&ne_ld2, &&and_ld2, &&or_ld2,
+    &&add_const, &&sub_const, &&mul_const, &&div_const, &&mod_const, &&lt_const, &&le_const,
+    &&gt_const, &&ge_const, &&eq_const, &&ne_const, &&and_const, &&or_const,
+    &&dup_tag_cjmpnz, &&drop_jmp, &&leave
+  };
+
+  if (ip == 0) {
+    handler_table = handlers;
+    return 0;
+  }
+
+# define NEXT    goto *(ip++)->handler
+  /* A binary operator together with its LD LD and CONST superinstructions */
+# define BINOP(name, e)                                                     \
+  name: { int y = POP, x = TOP; TOP = (e); NEXT; }                          \
+  name##_ld2: {                                                             \
+    int x = LOAD (ip[0].n, ip[1]), y = LOAD (ip[2].n, ip[3]);               \
+    ip += 4;                                                                \
+    PUSH (e);                                                               \
+    NEXT;                                                                   \
+  }                                                                         \
+  name##_const: { int y = (ip++)->n, x = TOP; TOP = (e); NEXT; }
+# define PATT(name, f)  name: TOP = f ((void*) TOP); NEXT;
+
+  NEXT;
+
+  BINOP (add, BOX (UNBOX (x) + UNBOX (y)))
+  BINOP (sub, BOX (UNBOX (x) - UNBOX (y)))
+  BINOP (mul, BOX (UNBOX (x) * UNBOX (y)))
+  BINOP (div, BOX (UNBOX (x) / UNBOX (y)))
+  BINOP (mod, BOX (UNBOX (x) % UNBOX (y)))
+  BINOP (lt,  BOX (x <  y))
+  BINOP (le,  BOX (x <= y))
+  BINOP (gt,  BOX (x >  y))
+  BINOP (ge,  BOX (x >= y))
+  BINOP (eq,  BOX (x == y))
+  BINOP (ne,  BOX (x != y))
+  BINOP (and, BOX (UNBOX (x) && UNBOX (y)))
+  BINOP (or,  BOX (UNBOX (x) || UNBOX (y)))
+
+ const_:
+  PUSH ((ip++)->n);
+  NEXT;
+
+ string: {
+    char  *s = (ip++)->s;
+    void  *r;
+    SYNC;
+    r = Bstring (s);
+    PUSH (r);
+    NEXT;
+  }
+
+ literal:
+  PUSH (*(ip++)->p);
+  NEXT;
+
+ sexp_: {
+    int   t = ip[0].n, n = ip[1].n, i;
+    sexp *r;
+    ip += 2;
+    SYNC;
+    r      = (sexp*) alloc_sexp (n);
+    r->tag = t;
+    for (i = 0; i < n; i++) r->contents[i] = sp[n-1-i];
+    sp += n;
+    PUSH (((data*) r)->contents);
+    NEXT;
+  }
+
+ sti: {
+    size_t v = POP, x = TOP;
+    TOP = (size_t) Bsti ((void*) v, (void**) x);
+    NEXT;
+  }
+
+ sta: {
+    size_t v = POP, i = POP;
+    if (UNBOXED (i)) TOP = (size_t) Bsta ((void*) v, i, (void*) TOP);
+    else PUSH (Bsti ((void*) v, (void**) i));
+    NEXT;
+  }
+
+ jmp:
+  ip = ip->target;
+  NEXT;
+
+ end: {
+    size_t r = TOP, *f = fp;
+    ip = (cell*) f[3];
+    sp = f + 4 + f[1];
+    fp = (size_t*) f[0];
+    PUSH (r);
+    NEXT;
+  }
+
+ drop:
+  sp++;
+  NEXT;
+
+ dup: {
+    size_t v = TOP;
+    PUSH (v);
+    NEXT;
+  }
+
+ swap: {
+    size_t v = sp[0];
+    sp[0] = sp[1];
+    sp[1] = v;
+    NEXT;
+  }
+
+ elem: {
+    size_t i = POP;
+    TOP = (size_t) Belem ((void*) TOP, i);
+    NEXT;
+  }
+
+ ld_global:   PUSH (*(ip++)->p); NEXT;
+ ld_frame:    PUSH (fp[(ip++)->n]); NEXT;
+ ld_closure:  PUSH (((size_t*) fp[2])[(ip++)->n]); NEXT;
+ lda_global:  PUSH ((ip++)->p); NEXT;
+ lda_frame:   PUSH (fp + (ip++)->n); NEXT;
+ lda_closure: PUSH ((size_t*) fp[2] + (ip++)->n); NEXT;
+ st_global:   *(ip++)->p = TOP; NEXT;
+ st_frame:    fp[(ip++)->n] = TOP; NEXT;
+
+ st_closure: {
+    size_t *slot = (size_t*) fp[2] + (ip++)->n;
+    *slot = TOP;
+    gc_write_barrier ((void**) slot, (void*) TOP);
+    NEXT;
+  }
+
+ cjmpz:
+  if (UNBOX (POP) == 0) ip = ip->target; else ip++;
+  NEXT;
+
+ cjmpnz:
+  if (UNBOX (POP) != 0) ip = ip->target; else ip++;
+  NEXT;
+
+ begin: {
+    function *f = ip[1].fn;
+    sp  = alloc_locals (p, sp, ip[0].n);
+    ip += 2;
+    if (f->code == 0 && f->calls >= 0 && ++f->calls >= jit_threshold) jit_compile (p, f);
+    if (f->code) {
+      sp = f->code (sp, fp);
+      ip = p->code + p->ret;
+    }
+    NEXT;
+  }
+
+ closure: {
+    cell *entry = ip[0].target, *d = ip + 2;
+    int   n     = ip[1].n, i;
+    data *r;
+    ip += 2 + 2*n;
+    SYNC;
+    r = (data*) alloc_closure (n + 1);
+    ((size_t*) r->contents)[0] = (size_t) entry;
+    for (i = 0; i < n; i++) ((size_t*) r->contents)[i+1] = LOAD (d[2*i].n, d[2*i+1]);
+    PUSH (r->contents);
+    NEXT;
+  }
+
+ callc: {
+    int    n = ip[0].n;
+    size_t c = sp[n];
+    ip += 3;
+    PUSH (ip);
+    PUSH (c);
+    PUSH (n + 1);
+    PUSH (fp);
+    fp = sp;
+    ip = *(cell**) c;
+    NEXT;
+  }
+
+ call: {
+    cell *target = ip[0].target;
+    int   n      = ip[1].n;
+    ip += 2;
+    PUSH (ip);
+    PUSH (BOX (0));
+    PUSH (n);
+    PUSH (fp);
+    fp = sp;
+    ip = target;
+    NEXT;
+  }
+
+ tag:
+  TOP = Btag ((void*) TOP, ip[0].n, ip[1].n);
+  ip += 2;
+  NEXT;
+
+ array:
+  TOP = Barray_patt ((void*) TOP, (ip++)->n);
+  NEXT;
+
+ fail:
+  SYNC;
+  Bmatch_failure ((void*) TOP, p->fname, ip[0].n, ip[1].n);
+  NEXT;
+
+ patt_str: {
+    size_t y = POP;
+    TOP = Bstring_patt ((void*) TOP, (void*) y);
+    NEXT;
+  }
+
+  PATT (patt_string,  Bstring_tag_patt)
+  PATT (patt_array,   Barray_tag_patt)
+  PATT (patt_sexp,    Bsexp_tag_patt)
+  PATT (patt_boxed,   Bboxed_patt)
+  PATT (patt_unboxed, Bunboxed_patt)
+  PATT (patt_closure, Bclosure_tag_patt)
+
+ read:
+  PUSH (Lread ());
+  NEXT;
+
+ write:
+  TOP = Lwrite (TOP);
+  NEXT;
+
+ length:
+  TOP = Llength ((void*) TOP);
+  NEXT;
+
+ lstring: {
+    void *r;
+    SYNC;
+    r   = Lstring ((void*) TOP);
+    TOP = (size_t) r;
+    NEXT;
+  }
+
+ barray: {
+    int   n = (ip++)->n, i;
+    data *r;
+    SYNC;
+    r = (data*) alloc_array (n);
+    for (i = 0; i < n; i++) ((size_t*) r->contents)[i] = sp[n-1-i];
+    sp += n;
+    PUSH (r->contents);
+    NEXT;
+  }
+
+ dup_tag_cjmpnz:
+  if (UNBOX (Btag ((void*) TOP, ip[0].n, ip[1].n)) != 0) ip = ip[2].target; else ip += 3;
+  NEXT;
+
+ drop_jmp:
+  sp++;
+  ip = ip->target;
+  NEXT;
+
+ leave:
+ stop:
+  return sp;
+
+# undef NEXT
+# undef BINOP
+# undef PATT
+}
+
+/* Translates and runs the main function of a bytecode file */
+static void run (bytefile *bf, char *fname) {
+  size_t  *stack = alloca (OPERAND_STACK_SIZE * sizeof (size_t)),
+          *sp;
+  void   **handlers;
+  program  p;
+
+  interpret (0, 0, 0, 0);
+  handlers = handler_table;
+
+  memset (&p, 0, sizeof (p));
+  jit_program = &p;
+
+  if (getenv ("LAMA_JIT_THRESHOLD")) jit_threshold = atoi (getenv ("LAMA_JIT_THRESHOLD"));
+  if (getenv ("LAMA_JIT_STRICT"))    jit_strict    = 1;
+
+  p.bf          = bf;
+  p.fname       = fname;
+  p.stack_limit = stack;
+  p.position    = (int*) malloc ((bf->code_size + 1) * sizeof (int));
+
+  if (p.position == 0) failure ("*** FAILURE: unable to allocate memory.\n");
+
+  translate (&p, handlers);
+
+  __init ();
+  __gc_stack_bottom = (size_t) (stack + OPERAND_STACK_SIZE);
+
+  p.globals  = stack + OPERAND_STACK_SIZE - bf->global_area_size;
+  p.literals = p.globals - p.literals_number;
+  p.code     = (cell*) malloc (p.code_size * sizeof (cell));
+
+  if (p.code == 0) failure ("*** FAILURE: unable to allocate memory.\n");
+
+  for (sp = p.literals; sp < stack + OPERAND_STACK_SIZE; sp++) *sp = BOX (0);
+
+  translate (&p, handlers);
+
+  /* main (argc, argv) */
+  sp    = p.literals;
+  *--sp = BOX (0);
+  *--sp = BOX (0);
+
+  interpret (&p, p.code + p.entry, sp, 0);
+}
+
 int main (int argc, char* argv[]) {
-  bytefile *f = read_file (argv[1]);
-  dump_file (stdout, f);
+  if (argc == 3 && strcmp (argv[1], "-d") == 0) {
+    dump_file (stdout, read_file (argv[2]));
+    return 0;
+  }
+
+  if (argc != 2) failure ("usage: byterun [-d] <file.bc>\n");
+
+  run (read_file (argv[1]), argv[1]);
+
   return 0;
 }
@@ -6,6 +6,8 @@
 
 #include <assert.h>
 #include <execinfo.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,18 +16,58 @@
 #include <time.h>
 #include <unistd.h>
 
-static const size_t INIT_HEAP_SIZE = MINIMUM_HEAP_CAPACITY;
+// see `GC heap sizing` in gc.h, sizes are in words
+static size_t heap_init_size     = MINIMUM_HEAP_CAPACITY;
+static size_t heap_max_size      = 0;
+static double heap_growth_factor = HEAP_GROWTH_FACTOR;
+static size_t heap_occupancy     = HEAP_TARGET_OCCUPANCY;
+// number of consecutive major collections after which the heap looked too big
+static int    heap_shrink_votes  = 0;
 
 #ifdef DEBUG_VERSION
 size_t cur_id = 0;
 #endif
 
 static extra_roots_pool extra_roots;
+static remembered_set   remembered;
+static int              gc_threads = 1;
+
+// see `GC parallel compaction` in gc.h
+static compaction_region *regions        = NULL;
+static size_t             regions_number = 0;
+
+// see `GC large object space` in gc.h
+static large_object_space large_objects;
+// large objects which are marked but not scanned yet (sequential marking only)
+static void **large_objects_to_scan          = NULL;
+static size_t large_objects_to_scan_size     = 0;
+static size_t large_objects_to_scan_capacity = 0;
+
+// see `GC side bitmaps` in gc.h
+static size_t *mark_bitmap  = NULL;
+static size_t *start_bitmap = NULL;
+// number of marked words of the collected area before each word of mark_bitmap
+static size_t *live_words_before = NULL;
+static size_t  bitmap_words      = 0;
 
 size_t __gc_stack_top = 0, __gc_stack_bottom = 0;
 #ifdef LAMA_ENV
 extern const size_t __start_custom_data, __stop_custom_data;
 #endif
+// see `GC stack maps` in gc.h, the section is absent if no compiled Lama code is linked in
+extern const stack_map __start_lama_stackmaps __attribute__((weak));
+extern const stack_map __stop_lama_stackmaps __attribute__((weak));
+// see `GC static objects` in gc.h, the section is absent if no compiled Lama code is linked in
+extern const size_t __start_lama_statics __attribute__((weak));
+extern const size_t __stop_lama_statics __attribute__((weak));
+
+static inline bool is_static_object (const size_t *p) {
+  return &__start_lama_statics < p && p < &__stop_lama_statics;
+}
+
+// stack maps sorted by return address
+static const stack_map **stack_maps        = NULL;
+static size_t            stack_maps_number = 0;
 
 #ifdef DEBUG_VERSION
 memory_chunk heap;
@@ -33,6 +75,22 @@ memory_chunk heap;
 static memory_chunk heap;
 #endif
 
+// see `GC heap reservation` in gc.h, both are in words
+static size_t heap_reserved_size  = 0;
+static size_t heap_committed_size = 0;
+
+// see `GC inline allocation` in gc.h
+size_t *__gc_alloc_ptr = NULL, *__gc_alloc_limit = NULL;
+
+// [heap.begin, nursery_begin) is the old space, [nursery_begin, __gc_alloc_ptr) is the nursery
+static size_t *nursery_begin = NULL;
+// offset (in words) of the collected area from heap.begin:
+// zero during a major collection, size of the old space during a minor one
+static size_t collect_offset = 0;
+// set during a minor collection; collect_offset is zero in a minor collection too if the old space is
+// empty, so it does not tell the kinds of collections apart
+static bool minor_collection = false;
+
 #ifdef DEBUG_VERSION
 void dump_heap ();
 #endif
@@ -57,9 +115,22 @@ void *alloc (size_t size) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "allocation of size %zu words (%zu bytes): ", size, bytes_sz);
 #endif
+  if (bytes_sz >= LARGE_OBJECT_THRESHOLD) {
+    if (large_objects.allocated_since_gc
+        >= MAX(WORDS_TO_BYTES(heap.size), LARGE_OBJECT_SPACE_TRIGGER)) {
+      // large objects are freed by major collections only
+      major_gc(0);
+    }
+    return alloc_large_object(bytes_sz);
+  }
   void *p = gc_alloc_on_existing_heap(size);
+  if (!p && __gc_alloc_ptr > nursery_begin) {
+    // the nursery is exhausted, try to free it by a minor collection first
+    minor_gc();
+    p = gc_alloc_on_existing_heap(size);
+  }
   if (!p) {
-    // not enough place in the heap, need to perform GC cycle
+    // not enough place in the heap, need to perform full GC cycle
     p = gc_alloc(size);
   }
   return p;
@@ -101,6 +172,8 @@ static FILE *print_stack_content (char *filename) {
 static void objects_dfs (FILE *f, void *obj_content) {
   void *obj_header = get_obj_header_ptr(obj_content);
   data *obj_data   = TO_DATA(obj_content);
+  // static objects are immortal and read-only, so they cannot carry the mark-bit below
+  if (is_static_object(obj_content)) { return; }
   // internal mark-bit for this dfs, should be recovered by the caller
   if ((obj_data->forward_address & 2) != 0) { return; }
   // set this bit as 1
@@ -135,8 +208,7 @@ FILE *print_objects_traversal (char *filename, bool marked) {
   for (heap_iterator it = heap_begin_iterator(); !heap_is_done_iterator(&it);
        heap_next_obj_iterator(&it)) {
     void *obj_header = it.current;
-    data *obj_data   = TO_DATA(get_object_content_ptr(obj_header));
-    if ((obj_data->forward_address & 1) == marked) {
+    if (is_marked(get_object_content_ptr(obj_header)) == marked) {
       objects_dfs(f, get_object_content_ptr(obj_header));
     }
   }
@@ -148,6 +220,9 @@ FILE *print_objects_traversal (char *filename, bool marked) {
     data *obj_data   = TO_DATA(get_object_content_ptr(obj_header));
     obj_data->forward_address &= (~2);
   }
+  for (size_t i = 0; i < large_objects.current_free; ++i) {
+    TO_DATA(get_object_content_ptr(large_objects.objects[i].begin))->forward_address &= (~2);
+  }
   fflush(f);
 
   // print extra roots
@@ -172,10 +247,27 @@ int files_cmp (FILE *f1, FILE *f2) {
 
 #endif
 
+// starts a new empty nursery right after the allocated objects
+static void reset_nursery (void) {
+  nursery_begin    = __gc_alloc_ptr;
+  __gc_alloc_limit = MIN(heap.end, nursery_begin + NURSERY_CAPACITY);
+}
+
+// sets start bits of the nursery objects: they are allocated by the generated code as well,
+// so the allocation itself does not touch the bitmaps
+static void note_nursery_objects (void) {
+  for (size_t *p = nursery_begin; p < __gc_alloc_ptr; p += BYTES_TO_WORDS(obj_size_header_ptr(p))) {
+    size_t offset = p - heap.begin;
+    start_bitmap[offset / BITMAP_WORD_BITS] |= (size_t)1 << (offset % BITMAP_WORD_BITS);
+  }
+}
+
 void *gc_alloc_on_existing_heap (size_t size) {
-  if (heap.current + size <= heap.end) {
-    void *p = (void *)heap.current;
-    heap.current += size;
+  // an object larger than the nursery is allowed to occupy an empty nursery alone
+  size_t *nursery_end = MIN(heap.end, nursery_begin + MAX(NURSERY_CAPACITY, size));
+  if (__gc_alloc_ptr + size <= nursery_end) {
+    void *p = (void *)__gc_alloc_ptr;
+    __gc_alloc_ptr += size;
     memset(p, 0, size * sizeof(size_t));
     return p;
   }
@@ -183,6 +275,11 @@ void *gc_alloc_on_existing_heap (size_t size) {
 }
 
 void *gc_alloc (size_t size) {
+  major_gc(size);
+  return gc_alloc_on_existing_heap(size);
+}
+
+void major_gc (size_t additional_size) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "===============================GC cycle has started\n");
 #endif
@@ -191,12 +288,18 @@ void *gc_alloc (size_t size) {
   FILE *heap_before  = print_objects_traversal("before-mark", 0);
   fclose(heap_before);
 #endif
+  // the whole heap is traced, thus old-to-young references need not be remembered
+  clear_remembered_set();
+  note_nursery_objects();
   mark_phase();
 #ifdef FULL_INVARIANT_CHECKS
   FILE *heap_before_compaction = print_objects_traversal("after-mark", 1);
 #endif
 
-  compact_phase(size);
+  compact_phase(additional_size);
+  sweep_large_objects();
+  // all the survivors are old now
+  reset_nursery();
 #ifdef FULL_INVARIANT_CHECKS
   FILE *stack_after           = print_stack_content("stack-dump-after-compaction");
   FILE *heap_after_compaction = print_objects_traversal("after-compaction", 0);
@@ -219,16 +322,470 @@ void *gc_alloc (size_t size) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "===============================GC cycle has finished\n");
 #endif
-  return gc_alloc_on_existing_heap(size);
 }
 
-static void gc_root_scan_stack () {
-  for (size_t *p = (size_t *)(__gc_stack_top + 4); p < (size_t *)__gc_stack_bottom; ++p) {
-    gc_test_and_mark_root((size_t **)p);
+static int compare_slots (const void *a, const void *b) {
+  void **x = *(void ***)a, **y = *(void ***)b;
+  return x < y ? -1 : x > y;
+}
+
+static void unique_remembered_set (void) {
+  if (remembered.current_free == 0) { return; }
+  qsort(remembered.slots, remembered.current_free, sizeof(void **), compare_slots);
+  size_t unique = 1;
+  for (size_t i = 1; i < remembered.current_free; ++i) {
+    if (remembered.slots[i] != remembered.slots[unique - 1]) {
+      remembered.slots[unique++] = remembered.slots[i];
+    }
+  }
+  remembered.current_free = unique;
+}
+
+void minor_gc (void) {
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "===============================minor GC cycle has started\n");
+#endif
+  minor_collection = true;
+  collect_offset   = nursery_begin - heap.begin;
+  // each remembered slot has to be fixed exactly once
+  unique_remembered_set();
+  note_nursery_objects();
+  mark_phase();
+  size_t live_size = compute_locations();
+  update_references();
+  physically_relocate();
+
+  __gc_alloc_ptr = heap.begin + live_size;
+  reset_nursery();
+  collect_offset   = 0;
+  minor_collection = false;
+  clear_remembered_set();
+  for (size_t i = 0; i < large_objects.current_free; ++i) { large_objects.objects[i].young = 0; }
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "===============================minor GC cycle has finished\n");
+#endif
+}
+
+// reserves address space for the heap, asks for less if the kernel cannot provide that much below 2GB
+static void heap_reserve (void) {
+  for (size_t size = HEAP_RESERVED_SIZE; size >= MINIMUM_HEAP_RESERVED_SIZE; size /= 2) {
+    void *p =
+        mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT | MAP_NORESERVE, -1, 0);
+    if (p != MAP_FAILED) {
+      heap.begin          = p;
+      heap_reserved_size  = BYTES_TO_WORDS(size);
+      heap_committed_size = 0;
+      break;
+    }
+  }
+  if (heap_reserved_size == 0) {
+    perror("ERROR: heap_reserve: mmap failed\n");
+    exit(1);
+  }
+#ifdef MADV_HUGEPAGE
+  char *huge_pages = getenv("LAMA_GC_HUGE_PAGES");
+  if (huge_pages != NULL && atoi(huge_pages) != 0
+      && madvise(heap.begin, WORDS_TO_BYTES(heap_reserved_size), MADV_HUGEPAGE) != 0) {
+    perror("WARNING: heap_reserve: transparent huge pages are not available\n");
+  }
+#endif
+}
+
+// makes exactly the first size words of the reserved space usable, pages are committed as a whole;
+// pages of the tail which is cut off are given back to the OS
+static void heap_resize (size_t size) {
+  if (size > heap_reserved_size) {
+    perror("ERROR: heap_resize: reserved address space is exhausted\n");
+    exit(1);
+  }
+  size_t page_words = BYTES_TO_WORDS(sysconf(_SC_PAGESIZE));
+  size_t committed  = MIN((size + page_words - 1) / page_words * page_words, heap_reserved_size);
+  if (committed > heap_committed_size) {
+    if (mprotect(heap.begin + heap_committed_size,
+                 WORDS_TO_BYTES(committed - heap_committed_size),
+                 PROT_READ | PROT_WRITE)
+        != 0) {
+      perror("ERROR: heap_resize: mprotect failed\n");
+      exit(1);
+    }
+  } else if (committed < heap_committed_size) {
+    size_t bytes = WORDS_TO_BYTES(heap_committed_size - committed);
+    if (madvise(heap.begin + committed, bytes, MADV_DONTNEED) != 0
+        || mprotect(heap.begin + committed, bytes, PROT_NONE) != 0) {
+      perror("ERROR: heap_resize: failed to release pages\n");
+      exit(1);
+    }
+  }
+  heap_committed_size = committed;
+  heap.size           = size;
+  heap.end            = heap.begin + size;
+}
+
+// reads a size in bytes (K, M and G suffixes are allowed) from the environment, returns it in words
+static size_t env_heap_size (const char *name, size_t default_size) {
+  char *value = getenv(name);
+  if (value == NULL) { return default_size; }
+  char  *suffix;
+  size_t size = strtoull(value, &suffix, 10);
+  switch (*suffix) {
+    case 'G': size <<= 10;   // fall through
+    case 'M': size <<= 10;   // fall through
+    case 'K': size <<= 10;
+    default: break;
+  }
+  return size == 0 ? default_size : BYTES_TO_WORDS(size);
+}
+
+static void heap_read_sizing_policy (void) {
+  heap_max_size  = MIN(env_heap_size("LAMA_GC_HEAP_MAX", heap_reserved_size), heap_reserved_size);
+  heap_init_size = MIN(MAX(env_heap_size("LAMA_GC_HEAP_INIT", MINIMUM_HEAP_CAPACITY), MINIMUM_HEAP_CAPACITY),
+                       heap_max_size);
+  char *growth       = getenv("LAMA_GC_HEAP_GROWTH");
+  heap_growth_factor = growth == NULL ? HEAP_GROWTH_FACTOR : MAX(atof(growth), 1.0);
+  char *occupancy    = getenv("LAMA_GC_HEAP_OCCUPANCY");
+  heap_occupancy     = occupancy == NULL ? HEAP_TARGET_OCCUPANCY : MIN(MAX(atoi(occupancy), 1), 100);
+  heap_shrink_votes  = 0;
+}
+
+// chooses the heap size after a major collection, live_size and additional_size are in words
+static size_t heap_next_size (size_t live_size, size_t additional_size) {
+  if (live_size + additional_size > heap_max_size) {
+    perror("ERROR: heap_next_size: maximal heap size is exceeded\n");
+    exit(1);
+  }
+  // extra room is reserved for the nursery
+  size_t wanted = MAX(live_size * 100 / heap_occupancy + additional_size + NURSERY_CAPACITY,
+                      heap_init_size);
+  wanted        = MIN(wanted, heap_max_size);
+  if (wanted > heap.size) {
+    heap_shrink_votes = 0;
+    return MIN(MAX(wanted, (size_t)(heap.size * heap_growth_factor)), heap_max_size);
+  }
+  // shrink only if the heap has been too big for several collections in a row
+  if (wanted * HEAP_SHRINK_SLACK > heap.size) {
+    heap_shrink_votes = 0;
+    return heap.size;
+  }
+  if (++heap_shrink_votes < HEAP_SHRINK_DELAY) { return heap.size; }
+  heap_shrink_votes = 0;
+  return wanted;
+}
+
+static inline heap_iterator collected_begin_iterator () {
+  heap_iterator it = {.current = heap.begin + collect_offset};
+  return it;
+}
+
+// checks if ptr_value points into the collected area of the heap before relocation
+static inline bool is_collected_pointer (size_t ptr_value) {
+  return (size_t)(heap.begin + collect_offset) <= ptr_value
+         && ptr_value <= (size_t)__gc_alloc_ptr;
+}
+
+/* Large object space */
+
+// returns the large object whose mapping contains p, NULL if there is no such object
+static large_object *large_object_containing (const void *p) {
+  if (large_objects.current_free == 0) { return NULL; }
+  large_object *objects = large_objects.objects;
+  long          lo = 0, hi = (long)large_objects.current_free - 1;
+  if ((char *)p < (char *)objects[lo].begin || (char *)p >= (char *)objects[hi].begin + objects[hi].size) {
+    return NULL;
+  }
+  while (lo <= hi) {
+    long mid = (lo + hi) / 2;
+    if ((char *)p < (char *)objects[mid].begin) {
+      hi = mid - 1;
+    } else if ((char *)p >= (char *)objects[mid].begin + objects[mid].size) {
+      lo = mid + 1;
+    } else {
+      return &objects[mid];
+    }
+  }
+  return NULL;
+}
+
+// returns the large object whose content p points to, NULL if there is no such object
+static inline large_object *find_large_object (const void *p) {
+  large_object *o = large_object_containing(p);
+  return o != NULL && (char *)p == (char *)o->begin + DATA_HEADER_SZ ? o : NULL;
+}
+
+bool is_large_object (const size_t *p) { return !UNBOXED(p) && find_large_object(p) != NULL; }
+
+void *alloc_large_object (size_t size) {
+  size_t  page_size    = sysconf(_SC_PAGESIZE);
+  size_t  mapping_size = (size + page_size - 1) / page_size * page_size;
+  size_t *p            = mmap(
+      NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+  if (p == MAP_FAILED) {
+    perror("ERROR: alloc_large_object: mmap failed\n");
+    exit(1);
+  }
+  if (large_objects.current_free == large_objects.capacity) {
+    size_t new_capacity = large_objects.capacity == 0 ? INIT_LARGE_OBJECT_SPACE_CAPACITY
+                                                      : 2 * large_objects.capacity;
+    large_object *new_objects =
+        realloc(large_objects.objects, new_capacity * sizeof(large_object));
+    if (new_objects == NULL) {
+      perror("ERROR: alloc_large_object: realloc failed\n");
+      exit(1);
+    }
+    large_objects.objects  = new_objects;
+    large_objects.capacity = new_capacity;
   }
+  // keep the objects sorted by address
+  size_t i = large_objects.current_free++;
+  for (; i > 0 && large_objects.objects[i - 1].begin > p; --i) {
+    large_objects.objects[i] = large_objects.objects[i - 1];
+  }
+  large_objects.objects[i] =
+      (large_object) {.begin = p, .size = mapping_size, .marked = 0, .young = 1};
+  large_objects.allocated_since_gc += mapping_size;
+  return p;
+}
+
+// large objects are marked by major collections only, their fields are scanned later by `mark`
+static void mark_large_object (void *obj) {
+  large_object *o;
+  if (minor_collection || (o = find_large_object(obj)) == NULL || o->marked) { return; }
+  o->marked = 1;
+  if (large_objects_to_scan_size == large_objects_to_scan_capacity) {
+    size_t new_capacity = large_objects_to_scan_capacity == 0 ? INIT_LARGE_OBJECT_SPACE_CAPACITY
+                                                              : 2 * large_objects_to_scan_capacity;
+    void **new_stack    = realloc(large_objects_to_scan, new_capacity * sizeof(void *));
+    if (new_stack == NULL) {
+      perror("ERROR: mark_large_object: realloc failed\n");
+      exit(1);
+    }
+    large_objects_to_scan          = new_stack;
+    large_objects_to_scan_capacity = new_capacity;
+  }
+  large_objects_to_scan[large_objects_to_scan_size++] = obj;
+}
+
+static inline bool try_mark_large_object (void *obj) {
+  large_object *o;
+  if (minor_collection || (o = find_large_object(obj)) == NULL) { return false; }
+  return __atomic_exchange_n(&o->marked, 1, __ATOMIC_RELAXED) == 0;
+}
+
+// minor collections treat large objects as old, but fields of the young ones are not remembered
+static void scan_young_large_objects (void) {
+  if (!minor_collection) { return; }
+  for (size_t i = 0; i < large_objects.current_free; ++i) {
+    if (!large_objects.objects[i].young) { continue; }
+    for (obj_field_iterator ptr_field_it = ptr_field_begin_iterator(large_objects.objects[i].begin);
+         !field_is_done_iterator(&ptr_field_it);
+         obj_next_ptr_field_iterator(&ptr_field_it)) {
+      mark(*(void **)ptr_field_it.cur_field);
+    }
+  }
+}
+
+void sweep_large_objects (void) {
+  size_t live = 0;
+  for (size_t i = 0; i < large_objects.current_free; ++i) {
+    large_object o = large_objects.objects[i];
+    if (!o.marked) {
+      munmap(o.begin, o.size);
+      continue;
+    }
+    o.marked                       = 0;
+    o.young                        = 0;
+    large_objects.objects[live++] = o;
+  }
+  large_objects.current_free       = live;
+  large_objects.allocated_since_gc = 0;
+}
+
+/* Side bitmaps */
+
+static inline bool bitmap_test (const size_t *bitmap, size_t i) {
+  return (bitmap[i / BITMAP_WORD_BITS] >> (i % BITMAP_WORD_BITS)) & 1;
+}
+
+static inline void bitmap_set (size_t *bitmap, size_t i) {
+  bitmap[i / BITMAP_WORD_BITS] |= (size_t)1 << (i % BITMAP_WORD_BITS);
+}
+
+// sets (or clears) bits [from, to), atomic version is used when several threads may update the same words
+static void bitmap_update_range (size_t *bitmap, size_t from, size_t to, bool value, bool atomic) {
+  while (from < to) {
+    size_t w    = from / BITMAP_WORD_BITS;
+    size_t hi   = MIN(to - w * BITMAP_WORD_BITS, BITMAP_WORD_BITS);
+    size_t mask = (hi == BITMAP_WORD_BITS ? ~(size_t)0 : ((size_t)1 << hi) - 1)
+                  & (~(size_t)0 << (from % BITMAP_WORD_BITS));
+    if (atomic) {
+      if (value) {
+        __atomic_fetch_or(&bitmap[w], mask, __ATOMIC_RELAXED);
+      } else {
+        __atomic_fetch_and(&bitmap[w], ~mask, __ATOMIC_RELAXED);
+      }
+    } else {
+      bitmap[w] = value ? bitmap[w] | mask : bitmap[w] & ~mask;
+    }
+    from = (w + 1) * BITMAP_WORD_BITS;
+  }
+}
+
+static size_t *bitmap_resize (size_t *bitmap, size_t words) {
+  size_t *new_bitmap = realloc(bitmap, words * sizeof(size_t));
+  if (new_bitmap == NULL) {
+    perror("ERROR: bitmap_resize: realloc failed\n");
+    exit(1);
+  }
+  memset(new_bitmap + bitmap_words, 0, (words - bitmap_words) * sizeof(size_t));
+  return new_bitmap;
+}
+
+// makes the bitmaps cover the whole heap
+static void bitmaps_ensure_capacity (void) {
+  // an extra word since a pointer to __gc_alloc_ptr is considered to be a valid one
+  size_t words = heap.size / BITMAP_WORD_BITS + 2;
+  if (words <= bitmap_words) { return; }
+  mark_bitmap       = bitmap_resize(mark_bitmap, words);
+  start_bitmap      = bitmap_resize(start_bitmap, words);
+  live_words_before = bitmap_resize(live_words_before, words);
+  bitmap_words      = words;
+}
+
+// returns offset (in words) of the first header of a live object in [from, to), or to if there is none
+static size_t next_live_object (size_t from, size_t to) {
+  if (from >= to) { return to; }
+  size_t w    = from / BITMAP_WORD_BITS;
+  size_t bits = mark_bitmap[w] & start_bitmap[w] & (~(size_t)0 << (from % BITMAP_WORD_BITS));
+  while (bits == 0) {
+    if (++w * BITMAP_WORD_BITS >= to) { return to; }
+    bits = mark_bitmap[w] & start_bitmap[w];
+  }
+  return MIN(w * BITMAP_WORD_BITS + __builtin_ctzl(bits), to);
+}
+
+// returns the offset a live object header located at the given offset is going to be moved to,
+// precondition: live_words_before is computed
+static inline size_t forward_offset (size_t offset) {
+  size_t w     = offset / BITMAP_WORD_BITS;
+  size_t below = ((size_t)1 << (offset % BITMAP_WORD_BITS)) - 1;
+  return collect_offset + live_words_before[w] + __builtin_popcountl(mark_bitmap[w] & below);
+}
+
+// clears the bitmaps of the collected area [collect_offset, end) and sets start bits of objects in
+// [collect_offset, live_end), i.e. of survivors after relocation
+static void reset_bitmaps (size_t end, size_t live_end) {
+  bitmap_update_range(mark_bitmap, collect_offset, end, false, false);
+  bitmap_update_range(start_bitmap, collect_offset, end, false, false);
+  for (size_t offset = collect_offset; offset < live_end;
+       offset += BYTES_TO_WORDS(obj_size_header_ptr(heap.begin + offset))) {
+    bitmap_set(start_bitmap, offset);
+  }
+}
+
+// translates ptr_value (pointer to an object content before relocation) into its new address
+static inline void *relocated_pointer (size_t ptr_value) {
+  size_t offset = (size_t *)TO_DATA(ptr_value) - heap.begin;
+  // all kinds of objects have headers of the same size
+  return (void *)(heap.begin + forward_offset(offset)) + DATA_HEADER_SZ;
+}
+
+/* Compaction regions */
+
+static inline size_t region_of (size_t offset) { return offset / COMPACTION_REGION_SIZE; }
+
+// makes the table of regions cover the whole heap
+static void regions_ensure_capacity (void) {
+  size_t number = (heap.size + COMPACTION_REGION_SIZE - 1) / COMPACTION_REGION_SIZE;
+  if (number <= regions_number) { return; }
+  compaction_region *new_regions = realloc(regions, number * sizeof(compaction_region));
+  if (new_regions == NULL) {
+    perror("ERROR: regions_ensure_capacity: realloc failed\n");
+    exit(1);
+  }
+  regions        = new_regions;
+  regions_number = number;
+}
+
+/* Stack maps */
+
+static int compare_stack_maps (const void *a, const void *b) {
+  size_t x = (*(const stack_map **)a)->return_address, y = (*(const stack_map **)b)->return_address;
+  return x < y ? -1 : x > y;
+}
+
+static void load_stack_maps (void) {
+  if (&__start_lama_stackmaps == NULL || &__stop_lama_stackmaps <= &__start_lama_stackmaps) {
+    return;
+  }
+  stack_maps_number = &__stop_lama_stackmaps - &__start_lama_stackmaps;
+  stack_maps        = malloc(stack_maps_number * sizeof(stack_map *));
+  if (stack_maps == NULL) {
+    perror("ERROR: load_stack_maps: malloc failed\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < stack_maps_number; ++i) { stack_maps[i] = &__start_lama_stackmaps + i; }
+  qsort(stack_maps, stack_maps_number, sizeof(stack_map *), compare_stack_maps);
+}
+
+static const stack_map *find_stack_map (size_t return_address) {
+  size_t lo = 0, hi = stack_maps_number;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (stack_maps[mid]->return_address < return_address) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo < stack_maps_number && stack_maps[lo]->return_address == return_address ? stack_maps[lo]
+                                                                                     : NULL;
+}
+
+// calls visit for each stack slot which may hold a managed value, each slot is visited once
+static void gc_walk_stack (void (*visit) (size_t *slot, void *arg), void *arg) {
+  size_t *bottom = (size_t *)__gc_stack_bottom;
+  // frame pointer and return address of the innermost runtime function
+  size_t *fp = (size_t *)__gc_stack_top, *return_slot = fp + 1;
+  while (return_slot < bottom) {
+    const stack_map *map = find_stack_map(*return_slot);
+    if (map == NULL) {
+      // with compiled Lama code linked in, every frame down to the bottom has a
+      // map unless a runtime function allocating through another one lacks
+      // PRE_GC (see `GC stack maps` in gc.h)
+      assert(stack_maps_number == 0 && "Lama frames are reached by the conservative scan");
+      break;
+    }
+    size_t *caller_fp = (size_t *)*fp;
+    for (int i = 1; i <= map->pushed; ++i) { visit(return_slot + i, arg); }
+    for (int w = 0; w < map->live_words; ++w) {
+      for (unsigned int bits = map->live_slots[w]; bits != 0; bits &= bits - 1) {
+        // slot i lies right below the frame pointer
+        visit(caller_fp - 1 - (w * 32 + __builtin_ctz(bits)), arg);
+      }
+    }
+    // the closure is pushed right before the frame pointer
+    if (map->has_closure) { visit(caller_fp + 1, arg); }
+    fp          = caller_fp;
+    return_slot = fp + (map->has_closure ? 2 : 1);
+  }
+  // the frames without stack maps are scanned conservatively
+  for (size_t *p = return_slot; p < bottom; ++p) { visit(p, arg); }
+}
+
+static void mark_root_slot (size_t *slot, void *arg) { gc_test_and_mark_root((size_t **)slot); }
+
+static void gc_root_scan_stack () { gc_walk_stack(mark_root_slot, NULL); }
+
+static inline bool parallel_gc_enabled (void) {
+  // minor collections are small enough to be done sequentially
+  return gc_threads > 1 && !minor_collection
+         && (size_t)(__gc_alloc_ptr - heap.begin) >= PARALLEL_GC_THRESHOLD;
 }
 
 void mark_phase (void) {
+  if (parallel_gc_enabled()) {
+    parallel_mark_phase();
+    return;
+  }
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "marking has started\n");
   fprintf(stderr,
@@ -251,75 +808,65 @@ void mark_phase (void) {
 #endif
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "scan_global_area has finished\n");
+#endif
+  scan_remembered_set();
+  scan_young_large_objects();
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "marking has finished\n");
 #endif
 }
 
 void compact_phase (size_t additional_size) {
-  size_t live_size = compute_locations();
-
-  // all in words
-  size_t next_heap_size =
-      MAX(live_size * EXTRA_ROOM_HEAP_COEFFICIENT + additional_size, MINIMUM_HEAP_CAPACITY);
-  size_t next_heap_pseudo_size = MAX(next_heap_size, heap.size);
-
-  memory_chunk old_heap = heap;
-  heap.begin            = mremap(
-      heap.begin, WORDS_TO_BYTES(heap.size), WORDS_TO_BYTES(next_heap_pseudo_size), MREMAP_MAYMOVE);
-  if (heap.begin == MAP_FAILED) {
-    perror("ERROR: compact_phase: mremap failed\n");
-    exit(1);
+  bool   parallel  = parallel_gc_enabled();
+  size_t live_size = parallel ? parallel_compute_locations() : compute_locations();
+
+  // in words
+  size_t next_heap_size = heap_next_size(live_size, additional_size);
+
+  // the heap never moves, growing it is just committing more of the reserved space
+  if (next_heap_size > heap.size) { heap_resize(next_heap_size); }
+  regions_ensure_capacity();
+  bitmaps_ensure_capacity();
+
+  if (parallel) {
+    parallel_update_references();
+    parallel_physically_relocate();
+  } else {
+    update_references();
+    physically_relocate();
   }
-  heap.end     = heap.begin + next_heap_pseudo_size;
-  heap.size    = next_heap_pseudo_size;
-  heap.current = heap.begin + (old_heap.current - old_heap.begin);
-
-  update_references(&old_heap);
-  physically_relocate(&old_heap);
 
-  heap.current = heap.begin + live_size;
+  __gc_alloc_ptr = heap.begin + live_size;
+  // the tail is released only after the live objects have been moved out of it
+  if (next_heap_size < heap.size) { heap_resize(next_heap_size); }
 }
 
 size_t compute_locations () {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC compute_locations started\n");
 #endif
-  size_t       *free_ptr  = heap.begin;
-  heap_iterator scan_iter = heap_begin_iterator();
-
-  for (; !heap_is_done_iterator(&scan_iter); heap_next_obj_iterator(&scan_iter)) {
-    void *header_ptr  = scan_iter.current;
-    void *obj_content = get_object_content_ptr(header_ptr);
-    if (is_marked(obj_content)) {
-      size_t sz = BYTES_TO_WORDS(obj_size_header_ptr(header_ptr));
-      // forward address is responsible for object header pointer
-      set_forward_address(obj_content, (size_t)free_ptr);
-      free_ptr += sz;
-    }
+  size_t end  = __gc_alloc_ptr - heap.begin;
+  size_t live = 0;
+  // mark bits below collect_offset are always zero
+  for (size_t w = collect_offset / BITMAP_WORD_BITS; w * BITMAP_WORD_BITS < end; ++w) {
+    live_words_before[w] = live;
+    live += __builtin_popcountl(mark_bitmap[w]);
   }
-
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC compute_locations finished\n");
 #endif
   // it will return number of words
-  return free_ptr - heap.begin;
+  return collect_offset + live;
 }
 
-void scan_and_fix_region (memory_chunk *old_heap, void *start, void *end) {
+void scan_and_fix_region (void *start, void *end) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC scan_and_fix_region started\n");
 #endif
   for (size_t *ptr = (size_t *)start; ptr < (size_t *)end; ++ptr) {
     size_t ptr_value = *ptr;
-    // this can't be expressed via is_valid_heap_pointer, because this pointer may point area corresponding to the old
-    // heap
-    if (is_valid_pointer((size_t *)ptr_value) && (size_t)old_heap->begin <= ptr_value
-        && ptr_value <= (size_t)old_heap->current) {
-      void *obj_ptr = (void *)heap.begin + ((void *)ptr_value - (void *)old_heap->begin);
-      void *new_addr =
-          (void *)heap.begin + ((void *)get_forward_address(obj_ptr) - (void *)old_heap->begin);
-      size_t content_offset = get_header_size(get_type_row_ptr(obj_ptr));
-      *(void **)ptr         = new_addr + content_offset;
+    if (is_valid_pointer((size_t *)ptr_value) && is_collected_pointer(ptr_value)) {
+      *(void **)ptr = relocated_pointer(ptr_value);
     }
   }
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
@@ -327,7 +874,7 @@ void scan_and_fix_region (memory_chunk *old_heap, void *start, void *end) {
 #endif
 }
 
-void scan_and_fix_region_roots (memory_chunk *old_heap) {
+void scan_and_fix_region_roots (void) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "extra roots started: number of extra roots %i\n", extra_roots.current_free);
 #endif
@@ -378,12 +925,8 @@ void scan_and_fix_region_roots (memory_chunk *old_heap) {
 #endif
       continue;
     }
-    if ((size_t)old_heap->begin <= ptr_value && ptr_value <= (size_t)old_heap->current) {
-      void *obj_ptr = (void *)heap.begin + ((void *)ptr_value - (void *)old_heap->begin);
-      void *new_addr =
-          (void *)heap.begin + ((void *)get_forward_address(obj_ptr) - (void *)old_heap->begin);
-      size_t content_offset = get_header_size(get_type_row_ptr(obj_ptr));
-      *(void **)ptr         = new_addr + content_offset;
+    if (is_collected_pointer(ptr_value)) {
+      *(void **)ptr = relocated_pointer(ptr_value);
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
       fprintf(stderr,
               "|\textra root (%p) %p -> %p\n",
@@ -398,86 +941,115 @@ void scan_and_fix_region_roots (memory_chunk *old_heap) {
 #endif
 }
 
-void update_references (memory_chunk *old_heap) {
-#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
-  fprintf(stderr, "GC update_references started\n");
-#endif
-  heap_iterator it = heap_begin_iterator();
-  while (!heap_is_done_iterator(&it)) {
-    if (is_marked(get_object_content_ptr(it.current))) {
-      for (obj_field_iterator field_iter = ptr_field_begin_iterator(it.current);
-           !field_is_done_iterator(&field_iter);
-           obj_next_ptr_field_iterator(&field_iter)) {
-
-        size_t *field_value = *(size_t **)field_iter.cur_field;
-        if (field_value < old_heap->begin || field_value > old_heap->current) { continue; }
-        // this pointer should also be modified according to old_heap->begin
-        void *field_obj_content_addr =
-            (void *)heap.begin + (*(void **)field_iter.cur_field - (void *)old_heap->begin);
-        // important, we calculate new_addr very carefully here, because objects may relocate to another memory chunk
-        void *new_addr =
-            heap.begin
-            + ((size_t *)get_forward_address(field_obj_content_addr) - (size_t *)old_heap->begin);
-        // update field reference to point to new_addr
-        // since, we want fields to point to an actual content, we need to add this extra content_offset
-        // because forward_address itself is a pointer to the object's header
-        size_t content_offset = get_header_size(get_type_row_ptr(field_obj_content_addr));
+static void fix_root_slot (size_t *slot, void *arg) {
+  size_t ptr_value = *slot;
+  if (is_valid_pointer((size_t *)ptr_value) && is_collected_pointer(ptr_value)) {
+    *(void **)slot = relocated_pointer(ptr_value);
+  }
+}
+
+// fixes old-to-young pointers, remembered slots themselves are never moved by a minor collection
+static void scan_and_fix_remembered_set (void) {
+  for (size_t i = 0; i < remembered.current_free; ++i) {
+    size_t *ptr       = (size_t *)remembered.slots[i];
+    size_t  ptr_value = *ptr;
+    if (is_valid_pointer((size_t *)ptr_value) && is_collected_pointer(ptr_value)) {
+      *(void **)ptr = relocated_pointer(ptr_value);
+    }
+  }
+}
+
+// fixes fields of a live object, header_ptr points to the object header
+static void update_object_references (void *header_ptr) {
+  for (obj_field_iterator field_iter = ptr_field_begin_iterator(header_ptr);
+       !field_is_done_iterator(&field_iter);
+       obj_next_ptr_field_iterator(&field_iter)) {
+
+    size_t field_value = *(size_t *)field_iter.cur_field;
+    if (!is_collected_pointer(field_value)) { continue; }
+    // since fields point to an actual content, the header size is added to the forward address
+    void *new_addr = relocated_pointer(field_value);
 #ifdef DEBUG_VERSION
-        if (!is_valid_heap_pointer((void *)(new_addr + content_offset))) {
+    if (!is_valid_heap_pointer((void *)new_addr)) {
 #  ifdef DEBUG_PRINT
-          fprintf(stderr,
-                  "ur: incorrect pointer assignment: on object with id %d",
-                  TO_DATA(get_object_content_ptr(it.current))->id);
+      fprintf(stderr,
+              "ur: incorrect pointer assignment: on object with id %d",
+              TO_DATA(get_object_content_ptr(header_ptr))->id);
 #  endif
-          exit(1);
-        }
-#endif
-        *(void **)field_iter.cur_field = new_addr + content_offset;
-      }
+      exit(1);
     }
-    heap_next_obj_iterator(&it);
+#endif
+    *(void **)field_iter.cur_field = new_addr;
   }
+}
+
+// fixes pointers from everything except the heap itself
+static void update_root_references (void) {
   // fix pointers from stack
-  scan_and_fix_region(old_heap, (void *)__gc_stack_top + 4, (void *)__gc_stack_bottom + 4);
+  gc_walk_stack(fix_root_slot, NULL);
 
   // fix pointers from extra_roots
-  scan_and_fix_region_roots(old_heap);
+  scan_and_fix_region_roots();
+
+  // fix pointers from the old space (minor collection only)
+  scan_and_fix_remembered_set();
+
+  // fix pointers from live large objects, a minor collection fixes the young ones only
+  // (the old ones are covered by the remembered set)
+  for (size_t i = 0; i < large_objects.current_free; ++i) {
+    large_object *o = &large_objects.objects[i];
+    if (minor_collection ? o->young : o->marked) { update_object_references(o->begin); }
+  }
 
 #ifdef LAMA_ENV
   assert((void *)&__stop_custom_data >= (void *)&__start_custom_data);
-  scan_and_fix_region(old_heap, (void *)&__start_custom_data, (void *)&__stop_custom_data);
+  scan_and_fix_region((void *)&__start_custom_data, (void *)&__stop_custom_data);
+#endif
+}
+
+void update_references (void) {
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "GC update_references started\n");
 #endif
+  size_t end = __gc_alloc_ptr - heap.begin;
+  for (size_t offset = next_live_object(collect_offset, end); offset < end;) {
+    size_t *header_ptr = heap.begin + offset;
+    update_object_references(header_ptr);
+    offset = next_live_object(offset + BYTES_TO_WORDS(obj_size_header_ptr(header_ptr)), end);
+  }
+  update_root_references();
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC update_references finished\n");
 #endif
 }
 
-void physically_relocate (memory_chunk *old_heap) {
+void physically_relocate (void) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC physically_relocate started\n");
 #endif
-  heap_iterator from_iter = heap_begin_iterator();
-
-  while (!heap_is_done_iterator(&from_iter)) {
-    void         *obj       = get_object_content_ptr(from_iter.current);
-    heap_iterator next_iter = from_iter;
-    heap_next_obj_iterator(&next_iter);
-    if (is_marked(obj)) {
-      // Move the object from its old location to its new location relative to
-      // the heap's (possibly new) location, 'to' points to future object header
-      size_t *to = heap.begin + ((size_t *)get_forward_address(obj) - (size_t *)old_heap->begin);
-      memmove(to, from_iter.current, obj_size_header_ptr(from_iter.current));
-      unmark_object(get_object_content_ptr(to));
-    }
-    from_iter = next_iter;
+  size_t end      = __gc_alloc_ptr - heap.begin;
+  size_t live_end = collect_offset;
+  for (size_t offset = next_live_object(collect_offset, end); offset < end;) {
+    size_t *from  = heap.begin + offset;
+    size_t  bytes = obj_size_header_ptr(from);
+    size_t  next  = offset + BYTES_TO_WORDS(bytes);
+    // Move the object from its old location to its new location relative to
+    // the heap's (possibly new) location, dead objects are skipped without touching them
+    size_t to = forward_offset(offset);
+    memmove(heap.begin + to, from, bytes);
+    live_end = to + BYTES_TO_WORDS(bytes);
+    offset   = next_live_object(next, end);
   }
+  reset_bitmaps(end, live_end);
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC physically_relocate finished\n");
 #endif
 }
 
 inline bool is_valid_heap_pointer (const size_t *p) {
-  return !UNBOXED(p) && (size_t)heap.begin <= (size_t)p && (size_t)p <= (size_t)heap.current;
+  return !UNBOXED(p)
+         && (((size_t)heap.begin <= (size_t)p && (size_t)p <= (size_t)__gc_alloc_ptr)
+             || is_static_object(p) || find_large_object(p) != NULL);
 }
 
 static inline bool is_valid_pointer (const size_t *p) { return !UNBOXED(p); }
@@ -499,12 +1071,18 @@ static inline void *queue_dequeue (heap_iterator *head_iter) {
   return value;
 }
 
-void mark (void *obj) {
-  if (!is_valid_heap_pointer(obj) || is_marked(obj)) { return; }
+// checks if p points into the area being collected (the whole heap or the nursery only)
+static inline bool is_collected_heap_pointer (const size_t *p) {
+  return !UNBOXED(p) && heap.begin + collect_offset <= p && p <= __gc_alloc_ptr;
+}
+
+static void mark_heap_object (void *obj) {
+  if (is_marked(obj)) { return; }
 
   // TL;DR: [q_head_iter, q_tail_iter) q_head_iter -- current dequeue's victim, q_tail_iter -- place for next enqueue
   // in forward_address of corresponding element we store address of element to be removed after dequeue operation
-  heap_iterator q_head_iter = heap_begin_iterator();
+  // (the queue is never longer than the number of collected objects, so it fits into the collected area)
+  heap_iterator q_head_iter = collected_begin_iterator();
   // iterator where we will write address of the element that is going to be enqueued
   heap_iterator q_tail_iter = q_head_iter;
   queue_enqueue(&q_tail_iter, obj);
@@ -520,10 +1098,11 @@ void mark (void *obj) {
          !field_is_done_iterator(&ptr_field_it);
          obj_next_ptr_field_iterator(&ptr_field_it)) {
       void *field_value = *(void **)ptr_field_it.cur_field;
-      if (!is_valid_heap_pointer(field_value) || is_marked(field_value)
-          || is_enqueued(field_value)) {
+      if (!is_collected_heap_pointer(field_value)) {
+        if (is_valid_pointer(field_value)) { mark_large_object(field_value); }
         continue;
       }
+      if (is_marked(field_value) || is_enqueued(field_value)) { continue; }
       // if we came to this point it must be true that field_value is unmarked and not currently in queue
       // thus, we maintain the invariant
       queue_enqueue(&q_tail_iter, field_value);
@@ -531,6 +1110,27 @@ void mark (void *obj) {
   }
 }
 
+static inline void mark_heap_or_large_object (void *obj) {
+  if (is_collected_heap_pointer(obj)) {
+    mark_heap_object(obj);
+  } else if (is_valid_pointer(obj)) {
+    mark_large_object(obj);
+  }
+}
+
+void mark (void *obj) {
+  mark_heap_or_large_object(obj);
+  // the marking queue lives in the heap, so large objects are scanned only when it is empty
+  while (large_objects_to_scan_size > 0) {
+    void *large = large_objects_to_scan[--large_objects_to_scan_size];
+    for (obj_field_iterator ptr_field_it = ptr_field_begin_iterator(get_obj_header_ptr(large));
+         !field_is_done_iterator(&ptr_field_it);
+         obj_next_ptr_field_iterator(&ptr_field_it)) {
+      mark_heap_or_large_object(*(void **)ptr_field_it.cur_field);
+    }
+  }
+}
+
 void scan_extra_roots (void) {
   for (int i = 0; i < extra_roots.current_free; ++i) {
     // this dereferencing is safe since runtime is pushing correct pointers into extra_roots
@@ -538,6 +1138,10 @@ void scan_extra_roots (void) {
   }
 }
 
+void scan_remembered_set (void) {
+  for (size_t i = 0; i < remembered.current_free; ++i) { mark(*remembered.slots[i]); }
+}
+
 #ifdef LAMA_ENV
 void scan_global_area (void) {
   // __start_custom_data is pointing to beginning of global area, thus all dereferencings are safe
@@ -547,6 +1151,381 @@ void scan_global_area (void) {
 }
 #endif
 
+/* Parallel GC workers */
+
+// runs routine on gc_threads threads, the i-th one gets (workers + i * worker_size) as an argument,
+// the current thread is used as the worker 0
+static void run_gc_workers (void *(*routine)(void *), void *workers, size_t worker_size) {
+  pthread_t threads[MAX_GC_THREADS];
+  for (int i = 1; i < gc_threads; ++i) {
+    if (pthread_create(&threads[i], NULL, routine, (char *)workers + i * worker_size) != 0) {
+      perror("ERROR: run_gc_workers: pthread_create failed\n");
+      exit(1);
+    }
+  }
+  routine(workers);
+  for (int i = 1; i < gc_threads; ++i) { pthread_join(threads[i], NULL); }
+}
+
+/* Parallel marking */
+
+static mark_worker mark_workers[MAX_GC_THREADS];
+// number of workers which may still produce new work, marking is finished when it drops to zero
+static int         mark_active_workers;
+
+// returns true if this call has marked the object, i.e. the caller is responsible for scanning it
+static inline bool try_mark_object (void *obj) {
+  size_t offset = (size_t *)TO_DATA(obj) - heap.begin;
+  size_t bit    = (size_t)1 << (offset % BITMAP_WORD_BITS);
+  // the header bit decides which thread owns the object
+  if (__atomic_fetch_or(&mark_bitmap[offset / BITMAP_WORD_BITS], bit, __ATOMIC_RELAXED) & bit) {
+    return false;
+  }
+  bitmap_update_range(
+      mark_bitmap, offset + 1, offset + BYTES_TO_WORDS(obj_size_row_ptr(obj)), true, true);
+  return true;
+}
+
+static mark_deque_buffer *mark_deque_buffer_create (long capacity, mark_deque_buffer *retired) {
+  mark_deque_buffer *b = malloc(sizeof(mark_deque_buffer) + capacity * sizeof(void *));
+  if (b == NULL) {
+    perror("ERROR: mark_deque_buffer_create: malloc failed\n");
+    exit(1);
+  }
+  b->capacity = capacity;
+  b->retired  = retired;
+  return b;
+}
+
+static void mark_deque_push (mark_worker *w, void *obj) {
+  long               bottom = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+  long               top    = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+  mark_deque_buffer *b      = __atomic_load_n(&w->buffer, __ATOMIC_RELAXED);
+  if (bottom - top > b->capacity - 1) {
+    // only the owner grows the deque, old buffer is kept alive until marking is finished
+    mark_deque_buffer *nb = mark_deque_buffer_create(2 * b->capacity, b);
+    for (long i = top; i < bottom; ++i) {
+      nb->objects[i & (nb->capacity - 1)] = b->objects[i & (b->capacity - 1)];
+    }
+    __atomic_store_n(&w->buffer, nb, __ATOMIC_RELEASE);
+    b = nb;
+  }
+  __atomic_store_n(&b->objects[bottom & (b->capacity - 1)], obj, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&w->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+// owner's end of the deque, returns NULL if the deque is empty
+static void *mark_deque_pop (mark_worker *w) {
+  long               bottom = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+  mark_deque_buffer *b      = __atomic_load_n(&w->buffer, __ATOMIC_RELAXED);
+  __atomic_store_n(&w->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long  top = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+  void *obj = NULL;
+  if (top <= bottom) {
+    obj = __atomic_load_n(&b->objects[bottom & (b->capacity - 1)], __ATOMIC_RELAXED);
+    if (top == bottom) {
+      // the last element, race against thieves
+      if (!__atomic_compare_exchange_n(
+              &w->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        obj = NULL;
+      }
+      __atomic_store_n(&w->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+  } else {
+    __atomic_store_n(&w->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return obj;
+}
+
+// thieves' end of the deque, returns NULL if the deque is empty or the race is lost
+static void *mark_deque_steal (mark_worker *w) {
+  long top = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long bottom = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+  if (top >= bottom) { return NULL; }
+  mark_deque_buffer *b   = __atomic_load_n(&w->buffer, __ATOMIC_ACQUIRE);
+  void              *obj = __atomic_load_n(&b->objects[top & (b->capacity - 1)], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(
+          &w->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return NULL;
+  }
+  return obj;
+}
+
+static bool mark_deque_is_empty (mark_worker *w) {
+  return __atomic_load_n(&w->top, __ATOMIC_ACQUIRE) >= __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+}
+
+static inline void parallel_mark_root (mark_worker *w, void *obj) {
+  if (is_collected_heap_pointer(obj)) {
+    if (try_mark_object(obj)) { mark_deque_push(w, obj); }
+  } else if (is_valid_pointer(obj) && try_mark_large_object(obj)) {
+    mark_deque_push(w, obj);
+  }
+}
+
+static void parallel_mark_root_slot (size_t *slot, void *arg) {
+  parallel_mark_root((mark_worker *)arg, *(void **)slot);
+}
+
+static void parallel_mark_fields (mark_worker *w, void *obj) {
+  for (obj_field_iterator ptr_field_it = ptr_field_begin_iterator(get_obj_header_ptr(obj));
+       !field_is_done_iterator(&ptr_field_it);
+       obj_next_ptr_field_iterator(&ptr_field_it)) {
+    parallel_mark_root(w, *(void **)ptr_field_it.cur_field);
+  }
+}
+
+static void *mark_steal_work (mark_worker *w) {
+  int first = rand_r(&w->seed) % gc_threads;
+  for (int i = 0; i < gc_threads; ++i) {
+    int victim = (first + i) % gc_threads;
+    if (victim == w->id) { continue; }
+    void *obj = mark_deque_steal(&mark_workers[victim]);
+    if (obj != NULL) { return obj; }
+  }
+  return NULL;
+}
+
+static bool mark_some_deque_is_nonempty (void) {
+  for (int i = 0; i < gc_threads; ++i) {
+    if (!mark_deque_is_empty(&mark_workers[i])) { return true; }
+  }
+  return false;
+}
+
+// each worker scans its own part of every root area
+static void parallel_scan_roots (mark_worker *w) {
+  size_t chunk;
+  if (stack_maps_number > 0) {
+    // frames have to be walked one by one
+    if (w->id == 0) { gc_walk_stack(parallel_mark_root_slot, w); }
+  } else {
+    size_t *stack_begin = (size_t *)(__gc_stack_top + 4), *stack_end = (size_t *)__gc_stack_bottom;
+    size_t  stack_size  = stack_end > stack_begin ? stack_end - stack_begin : 0;
+    chunk               = (stack_size + gc_threads - 1) / gc_threads;
+    for (size_t i = w->id * chunk; i < MIN((w->id + 1) * chunk, stack_size); ++i) {
+      parallel_mark_root(w, *(void **)(stack_begin + i));
+    }
+  }
+  for (int i = w->id; i < extra_roots.current_free; i += gc_threads) {
+    parallel_mark_root(w, *extra_roots.roots[i]);
+  }
+  for (size_t i = w->id; i < remembered.current_free; i += gc_threads) {
+    parallel_mark_root(w, *remembered.slots[i]);
+  }
+#ifdef LAMA_ENV
+  size_t globals_size = (size_t *)&__stop_custom_data - (size_t *)&__start_custom_data;
+  chunk               = (globals_size + gc_threads - 1) / gc_threads;
+  for (size_t i = w->id * chunk; i < MIN((w->id + 1) * chunk, globals_size); ++i) {
+    parallel_mark_root(w, *(void **)((size_t *)&__start_custom_data + i));
+  }
+#endif
+}
+
+static void *parallel_mark_worker (void *arg) {
+  mark_worker *w = (mark_worker *)arg;
+  parallel_scan_roots(w);
+  while (true) {
+    void *obj;
+    while ((obj = mark_deque_pop(w)) != NULL) { parallel_mark_fields(w, obj); }
+    if ((obj = mark_steal_work(w)) != NULL) {
+      parallel_mark_fields(w, obj);
+      continue;
+    }
+    // no work is found: become idle until either someone has work to share or everybody is idle
+    __atomic_sub_fetch(&mark_active_workers, 1, __ATOMIC_SEQ_CST);
+    while (true) {
+      if (mark_some_deque_is_nonempty()) {
+        __atomic_add_fetch(&mark_active_workers, 1, __ATOMIC_SEQ_CST);
+        if ((obj = mark_steal_work(w)) != NULL) { break; }
+        __atomic_sub_fetch(&mark_active_workers, 1, __ATOMIC_SEQ_CST);
+      }
+      if (__atomic_load_n(&mark_active_workers, __ATOMIC_SEQ_CST) == 0) { return NULL; }
+      sched_yield();
+    }
+    parallel_mark_fields(w, obj);
+  }
+}
+
+void parallel_mark_phase (void) {
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "parallel marking has started: %d threads\n", gc_threads);
+#endif
+  mark_active_workers = gc_threads;
+  for (int i = 0; i < gc_threads; ++i) {
+    mark_workers[i].id     = i;
+    mark_workers[i].seed   = i + 1;
+    mark_workers[i].top    = 0;
+    mark_workers[i].bottom = 0;
+    mark_workers[i].buffer = mark_deque_buffer_create(INIT_MARK_DEQUE_CAPACITY, NULL);
+  }
+  run_gc_workers(parallel_mark_worker, mark_workers, sizeof(mark_worker));
+
+  for (int i = 0; i < gc_threads; ++i) {
+    mark_deque_buffer *b = mark_workers[i].buffer;
+    while (b != NULL) {
+      mark_deque_buffer *retired = b->retired;
+      free(b);
+      b = retired;
+    }
+    mark_workers[i].buffer = NULL;
+  }
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "parallel marking has finished\n");
+#endif
+}
+
+/* Parallel compaction */
+
+// number of regions covering [heap.begin, __gc_alloc_ptr)
+static size_t        compaction_regions_number;
+// counter used by workers to claim regions in increasing order
+static size_t        next_compaction_region;
+static void (*compaction_region_task) (size_t);
+
+static void *compaction_worker (void *arg) {
+  size_t r;
+  while ((r = __atomic_fetch_add(&next_compaction_region, 1, __ATOMIC_RELAXED))
+         < compaction_regions_number) {
+    compaction_region_task(r);
+  }
+  return NULL;
+}
+
+static void run_compaction_task (void (*task)(size_t)) {
+  compaction_region_task = task;
+  next_compaction_region = 0;
+  run_gc_workers(compaction_worker, NULL, 0);
+}
+
+// bounds (in words) of the region's part of [heap.begin, __gc_alloc_ptr)
+static inline size_t region_begin (size_t r) { return r * COMPACTION_REGION_SIZE; }
+
+static inline size_t region_end (size_t r) {
+  return MIN((r + 1) * COMPACTION_REGION_SIZE, (size_t)(__gc_alloc_ptr - heap.begin));
+}
+
+static void region_count_marked_words (size_t r) {
+  compaction_region *region = &regions[r];
+  region->marked_words      = 0;
+  region->relocated         = 0;
+  for (size_t w = region_begin(r) / BITMAP_WORD_BITS; w * BITMAP_WORD_BITS < region_end(r); ++w) {
+    region->marked_words += __builtin_popcountl(mark_bitmap[w]);
+  }
+}
+
+// precondition: marked_words of the region holds the number of marked words before it
+static void region_compute_locations (size_t r) {
+  compaction_region *region = &regions[r];
+  size_t             live   = region->marked_words;
+  for (size_t w = region_begin(r) / BITMAP_WORD_BITS; w * BITMAP_WORD_BITS < region_end(r); ++w) {
+    live_words_before[w] = live;
+    live += __builtin_popcountl(mark_bitmap[w]);
+  }
+  // objects whose headers lie in the region, the last one may span over the following regions
+  region->live_size = region->source_begin = region->source_end = 0;
+  for (size_t offset = next_live_object(region_begin(r), region_end(r)); offset < region_end(r);) {
+    size_t sz = BYTES_TO_WORDS(obj_size_header_ptr(heap.begin + offset));
+    if (region->live_size == 0) { region->source_begin = offset; }
+    region->live_size += sz;
+    region->source_end = offset + sz;
+    offset             = next_live_object(offset + sz, region_end(r));
+  }
+}
+
+static void region_update_references (size_t r) {
+  compaction_region *region = &regions[r];
+  for (size_t offset = next_live_object(region->source_begin, region->source_end);
+       offset < region->source_end;) {
+    size_t *header_ptr = heap.begin + offset;
+    update_object_references(header_ptr);
+    offset = next_live_object(offset + BYTES_TO_WORDS(obj_size_header_ptr(header_ptr)),
+                              region->source_end);
+  }
+}
+
+static void region_relocate (size_t r) {
+  compaction_region *region = &regions[r];
+  if (region->live_size != 0) {
+    // lower regions are moved no later than this one, so it is enough to wait for those
+    // whose objects lie in the destination of this region
+    size_t destination     = region->destination;
+    size_t destination_end = destination + region->live_size;
+    for (size_t q = r; q-- > 0;) {
+      if (regions[q].live_size == 0) { continue; }
+      if (regions[q].source_end <= destination) { break; }
+      if (regions[q].source_begin < destination_end) {
+        while (!__atomic_load_n(&regions[q].relocated, __ATOMIC_ACQUIRE)) { sched_yield(); }
+      }
+    }
+    for (size_t offset = region->source_begin; offset < region->source_end;) {
+      size_t *from  = heap.begin + offset;
+      size_t  bytes = obj_size_header_ptr(from);
+      size_t  next  = offset + BYTES_TO_WORDS(bytes);
+      memmove(heap.begin + forward_offset(offset), from, bytes);
+      offset = next_live_object(next, region->source_end);
+    }
+  }
+  __atomic_store_n(&region->relocated, 1, __ATOMIC_RELEASE);
+}
+
+// regions are aligned to bitmap words, so no synchronization is needed here
+static void region_clear_bitmaps (size_t r) {
+  for (size_t w = region_begin(r) / BITMAP_WORD_BITS; w * BITMAP_WORD_BITS < region_end(r); ++w) {
+    mark_bitmap[w]  = 0;
+    start_bitmap[w] = 0;
+  }
+}
+
+// precondition: live_words_before is not changed since relocation
+static void region_note_relocated_objects (size_t r) {
+  compaction_region *region = &regions[r];
+  if (region->live_size == 0) { return; }
+  size_t destination = region->destination;
+  for (size_t offset = destination; offset < destination + region->live_size;
+       offset += BYTES_TO_WORDS(obj_size_header_ptr(heap.begin + offset))) {
+    bitmap_update_range(start_bitmap, offset, offset + 1, true, true);
+  }
+}
+
+size_t parallel_compute_locations (void) {
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "GC parallel_compute_locations started\n");
+#endif
+  compaction_regions_number =
+      region_of(__gc_alloc_ptr - heap.begin + COMPACTION_REGION_SIZE - 1);
+  run_compaction_task(region_count_marked_words);
+  // prefix sums of marked words
+  size_t live = 0;
+  for (size_t r = 0; r < compaction_regions_number; ++r) {
+    size_t marked_words     = regions[r].marked_words;
+    regions[r].marked_words = live;
+    live += marked_words;
+  }
+  run_compaction_task(region_compute_locations);
+  for (size_t r = 0; r < compaction_regions_number; ++r) {
+    if (regions[r].live_size != 0) { regions[r].destination = forward_offset(regions[r].source_begin); }
+  }
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "GC parallel_compute_locations finished\n");
+#endif
+  return collect_offset + live;
+}
+
+void parallel_update_references (void) {
+  run_compaction_task(region_update_references);
+  update_root_references();
+}
+
+void parallel_physically_relocate (void) {
+  run_compaction_task(region_relocate);
+  run_compaction_task(region_clear_bitmaps);
+  run_compaction_task(region_note_relocated_objects);
+}
+
 extern void gc_test_and_mark_root (size_t **root) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr,
@@ -566,31 +1545,57 @@ void __gc_init (void) {
 
 void __init (void) {
   signal(SIGSEGV, handler);
-  size_t space_size = INIT_HEAP_SIZE * sizeof(size_t);
-
   srandom(time(NULL));
 
-  heap.begin = mmap(
-      NULL, space_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
-  if (heap.begin == MAP_FAILED) {
-    perror("ERROR: __init: mmap failed\n");
-    exit(1);
-  }
-  heap.end     = heap.begin + INIT_HEAP_SIZE;
-  heap.size    = INIT_HEAP_SIZE;
-  heap.current = heap.begin;
+  char *threads = getenv("LAMA_GC_THREADS");
+  gc_threads    = threads == NULL ? 1 : MIN(MAX(atoi(threads), 1), MAX_GC_THREADS);
+
+  if (stack_maps == NULL) { load_stack_maps(); }
+  heap_reserve();
+  heap_read_sizing_policy();
+  heap_resize(heap_init_size);
+  __gc_alloc_ptr = heap.begin;
+  reset_nursery();
+  regions_ensure_capacity();
+  bitmaps_ensure_capacity();
   clear_extra_roots();
+  clear_remembered_set();
 }
 
 extern void __shutdown (void) {
-  munmap(heap.begin, heap.size);
+  munmap(heap.begin, WORDS_TO_BYTES(heap_reserved_size));
+  heap_reserved_size  = 0;
+  heap_committed_size = 0;
+  free(regions);
+  regions        = NULL;
+  regions_number = 0;
+  free(mark_bitmap);
+  free(start_bitmap);
+  free(live_words_before);
+  mark_bitmap = start_bitmap = live_words_before = NULL;
+  bitmap_words                                   = 0;
+  free(remembered.slots);
+  remembered.slots    = NULL;
+  remembered.capacity = 0;
+  clear_remembered_set();
+  for (size_t i = 0; i < large_objects.current_free; ++i) {
+    munmap(large_objects.objects[i].begin, large_objects.objects[i].size);
+  }
+  free(large_objects.objects);
+  large_objects = (large_object_space) {0};
+  free(large_objects_to_scan);
+  large_objects_to_scan          = NULL;
+  large_objects_to_scan_size     = 0;
+  large_objects_to_scan_capacity = 0;
 #ifdef DEBUG_VERSION
   cur_id = 0;
 #endif
   heap.begin        = NULL;
   heap.end          = NULL;
   heap.size         = 0;
-  heap.current      = NULL;
+  __gc_alloc_ptr    = NULL;
+  __gc_alloc_limit  = NULL;
+  nursery_begin     = NULL;
   __gc_stack_top    = 0;
   __gc_stack_bottom = 0;
 }
@@ -619,9 +1624,42 @@ void pop_extra_root (void **p) {
   }
 }
 
+void clear_remembered_set (void) { remembered.current_free = 0; }
+
+void gc_write_barrier (void **slot, void *value) {
+  // only pointers from the old space (or old large objects) to the nursery are of interest
+  if (UNBOXED(value) || (size_t *)value < nursery_begin || (size_t *)value > __gc_alloc_ptr
+      || ((size_t *)slot >= nursery_begin && (size_t *)slot < heap.end)) {
+    return;
+  }
+  if ((size_t *)slot < heap.begin || (size_t *)slot >= heap.end) {
+    // fields of young large objects are scanned by the next minor collection anyway
+    large_object *o = large_object_containing(slot);
+    if (o == NULL || o->young) { return; }
+  }
+  // cheap deduplication of repeated stores into the same slot
+  if (remembered.current_free > 0 && remembered.slots[remembered.current_free - 1] == slot) {
+    return;
+  }
+  if (remembered.current_free == remembered.capacity) {
+    size_t new_capacity =
+        remembered.capacity == 0 ? INIT_REMEMBERED_SET_CAPACITY : 2 * remembered.capacity;
+    void ***new_slots = realloc(remembered.slots, new_capacity * sizeof(void **));
+    if (new_slots == NULL) {
+      perror("ERROR: gc_write_barrier: remembered set realloc failed\n");
+      exit(1);
+    }
+    remembered.slots    = new_slots;
+    remembered.capacity = new_capacity;
+  }
+  remembered.slots[remembered.current_free++] = slot;
+}
+
 /* Functions for tests */
 
 #if defined(DEBUG_VERSION)
+size_t large_objects_number (void) { return large_objects.current_free; }
+
 size_t objects_snapshot (int *object_ids_buf, size_t object_ids_buf_size) {
   size_t *ids_ptr = (size_t *)object_ids_buf;
   size_t  i       = 0;
@@ -683,19 +1721,19 @@ void set_forward_address (void *obj, size_t addr) {
 }
 
 bool is_marked (void *obj) {
-  data *d        = TO_DATA(obj);
-  int   mark_bit = GET_MARK_BIT(d->forward_address);
-  return mark_bit;
+  return bitmap_test(mark_bitmap, (size_t *)TO_DATA(obj) - heap.begin);
 }
 
 void mark_object (void *obj) {
-  data *d = TO_DATA(obj);
-  SET_MARK_BIT(d->forward_address);
+  size_t offset = (size_t *)TO_DATA(obj) - heap.begin;
+  bitmap_update_range(
+      mark_bitmap, offset, offset + BYTES_TO_WORDS(obj_size_row_ptr(obj)), true, false);
 }
 
 void unmark_object (void *obj) {
-  data *d = TO_DATA(obj);
-  RESET_MARK_BIT(d->forward_address);
+  size_t offset = (size_t *)TO_DATA(obj) - heap.begin;
+  bitmap_update_range(
+      mark_bitmap, offset, offset + BYTES_TO_WORDS(obj_size_row_ptr(obj)), false, false);
 }
 
 bool is_enqueued (void *obj) {
@@ -726,7 +1764,7 @@ void heap_next_obj_iterator (heap_iterator *it) {
   it->current += obj_size;
 }
 
-bool heap_is_done_iterator (heap_iterator *it) { return it->current >= heap.current; }
+bool heap_is_done_iterator (heap_iterator *it) { return it->current >= __gc_alloc_ptr; }
 
 lama_type get_type_row_ptr (void *ptr) {
   data *data_ptr = TO_DATA(ptr);
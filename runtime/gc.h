@@ -17,31 +17,39 @@
 //  - void compact_phase (size_t additional_size): the whole compaction phase
 // can be understood by looking at this piece of code plus couple of other
 // functions used in there. It is basically an implementation of LISP2.
+//  - void minor_gc (): the heap is split into two generations. Objects are
+// bump-allocated into the nursery, which is the tail of the heap right after
+// the old (already compacted) space. When the nursery is exhausted only young
+// objects are marked (roots plus the remembered set) and slid towards the end
+// of the old space using the same LISP2 passes, i.e. survivors get promoted.
+// Full (major) collections are performed only when the old space is full.
 
 #ifndef __LAMA_GC__
 #define __LAMA_GC__
 
 #include "runtime_common.h"
 
-#define GET_MARK_BIT(x) (((int)(x)) & 1)
-#define SET_MARK_BIT(x) (x = (((int)(x)) | 1))
 #define IS_ENQUEUED(x) (((int)(x)) & 2)
 #define MAKE_ENQUEUED(x) (x = (((int)(x)) | 2))
 #define MAKE_DEQUEUED(x) (x = (((int)(x)) & (~2)))
-#define RESET_MARK_BIT(x) (x = (((int)(x)) & (~1)))
-// since last 2 bits are used for mark-bit and enqueued-bit and due to correct
-// alignment we can expect that last 2 bits don't influence address (they
-// should always be zero)
+// forward address field is used as a link of the marking queue only (mark bits
+// live in a side bitmap), its last 2 bits are reserved for the enqueued-bit and
+// due to correct alignment we can expect that they don't influence address
+// (they should always be zero)
 #define GET_FORWARD_ADDRESS(x) (((size_t)(x)) & (~3))
 // take the last two bits as they are and make all others zero
 #define SET_FORWARD_ADDRESS(x, addr) (x = ((x & 3) | ((int)(addr))))
-// if heap is full after gc shows in how many times it has to be extended
-#define EXTRA_ROOM_HEAP_COEFFICIENT 2
 #ifdef DEBUG_VERSION
 #  define MINIMUM_HEAP_CAPACITY (8)
 #else
 #  define MINIMUM_HEAP_CAPACITY (1 << 2)
 #endif
+// maximal size of the nursery in words, objects bigger than that are allocated in an empty nursery
+#ifdef DEBUG_VERSION
+#  define NURSERY_CAPACITY (1 << 6)
+#else
+#  define NURSERY_CAPACITY (1 << 16)
+#endif
 
 #include <stdbool.h>
 #include <stddef.h>
@@ -62,24 +70,67 @@ typedef struct {
 typedef struct {
   size_t *begin;
   size_t *end;
-  size_t *current;
   size_t  size;
 } memory_chunk;
 
 
+// ============================================================================
+//                          GC heap reservation
+// ============================================================================
+// The heap never moves: HEAP_RESERVED_SIZE bytes of address space are reserved
+// (with no access) during `__init`, halving the request down to
+// MINIMUM_HEAP_RESERVED_SIZE if the kernel cannot find that much below 2GB.
+// Growing the heap commits more pages of the reservation, so neither the heap
+// is copied nor pointers are rebased. Setting LAMA_GC_HUGE_PAGES=1 asks for
+// transparent huge pages for the reservation.
+#ifdef DEBUG_VERSION
+#  define HEAP_RESERVED_SIZE ((size_t)1 << 26)
+#else
+#  define HEAP_RESERVED_SIZE ((size_t)1 << 30)
+#endif
+#define MINIMUM_HEAP_RESERVED_SIZE ((size_t)1 << 22)
+
+
+// ============================================================================
+//                             GC heap sizing
+// ============================================================================
+// After a major collection the heap is sized so that live objects occupy the
+// target fraction of it (plus room for the nursery). The heap grows at least
+// by the growth factor, and shrinks (giving the pages of the tail back to the
+// OS) only after HEAP_SHRINK_DELAY consecutive collections have found it more
+// than HEAP_SHRINK_SLACK times bigger than needed.
+// The policy is read from the environment during `__init`:
+//  - LAMA_GC_HEAP_INIT: initial (and minimal) heap size in bytes,
+//  - LAMA_GC_HEAP_MAX: maximal heap size in bytes, the reserved size by default,
+//  - LAMA_GC_HEAP_GROWTH: growth factor,
+//  - LAMA_GC_HEAP_OCCUPANCY: target occupancy in percent.
+// Sizes may have K, M or G suffix.
+#define HEAP_GROWTH_FACTOR 2.0
+#define HEAP_TARGET_OCCUPANCY 50
+#define HEAP_SHRINK_SLACK 4
+#define HEAP_SHRINK_DELAY 3
+
 // the only GC-related function that should be exposed, others are useful for tests and internal implementation
 // allocates object of the given size on the heap
 void *alloc(size_t);
 // takes number of words as a parameter
 void *gc_alloc(size_t);
+// collects the whole heap, takes number of words that are required to be allocated afterwards
+void major_gc (size_t additional_size);
 // takes number of words as a parameter
 void *gc_alloc_on_existing_heap(size_t);
+// collects the nursery only, survivors are promoted to the old space
+void minor_gc (void);
 
 // specific for mark-and-compact_phase gc
 void mark (void *obj);
 void mark_phase (void);
 // marks each pointer from extra roots
 void scan_extra_roots (void);
+// marks each pointer stored in the remembered slots
+void scan_remembered_set (void);
+// marks the whole collected area using several GC threads (see `GC parallel marking` below)
+void parallel_mark_phase (void);
 #ifdef LAMA_ENV
 // marks each valid pointer from global area
 void scan_global_area (void);
@@ -88,8 +139,8 @@ void scan_global_area (void);
 void compact_phase (size_t additional_size);
 // specific for Lisp-2 algorithm
 size_t compute_locations ();
-void   update_references (memory_chunk *);
-void   physically_relocate (memory_chunk *);
+void   update_references (void);
+void   physically_relocate (void);
 
 
 // ============================================================================
@@ -113,6 +164,201 @@ void push_extra_root (void **p);
 void pop_extra_root (void **p);
 
 
+// ============================================================================
+//                          GC remembered set
+// ============================================================================
+// Minor collections do not trace the old space, so every slot of an old object
+// which may refer to a young one is recorded in the remembered set by the write
+// barrier. The set is a growable array of slot addresses, it is consumed (and
+// cleared) by each collection.
+#define INIT_REMEMBERED_SET_CAPACITY 64
+
+typedef struct {
+  size_t  current_free;
+  size_t  capacity;
+  void ***slots;
+} remembered_set;
+
+void clear_remembered_set (void);
+// write barrier: must be called after `value` has been stored into `slot`
+void gc_write_barrier (void **slot, void *value);
+
+
+// ============================================================================
+//                            GC stack maps
+// ============================================================================
+// The X86 backend emits a stack map for each call site into `lama_stackmaps`
+// section. Given a return address, the map tells which words of the caller's
+// frame may hold managed values: the words pushed by the call site (arguments
+// and saved registers), frame slots (locals and live temporaries) and the
+// closure slot. Starting from the innermost runtime function, frames are walked
+// through saved frame pointers, so return addresses, saved frame pointers and
+// dead temporaries are never taken for roots. The rest of the stack starting
+// from the first frame without a map (e.g. a virtual stack of the tests) is
+// scanned conservatively. Frames of compiled code must never get there, since
+// prologues leave the slots which are written before any call uninitialised: a
+// runtime function called from Lama which allocates through another one has to
+// start the walk itself with PRE_GC, so that it begins at a Lama return address.
+typedef struct {
+  size_t              return_address;
+  int                 has_closure;   // the caller's frame has the closure slot
+  int                 pushed;        // number of words pushed by the call site
+  int                 live_words;    // size of live_slots
+  const unsigned int *live_slots;    // bitmap of the caller's frame slots
+} stack_map;
+
+
+// ============================================================================
+//                          GC inline allocation
+// ============================================================================
+// The heap is allocated by bumping `__gc_alloc_ptr`, which is exported together
+// with `__gc_alloc_limit` (the end of the current nursery), so the X86 backend
+// allocates small s-expressions, arrays and closures inline: if the bumped
+// pointer does not exceed the limit, the object header is filled in place
+// (the layout of a production object is [header][forward address][contents]),
+// otherwise `Balloc` is called. Since generated code does not know about the
+// side bitmaps, start bits of the nursery objects are set at the beginning of
+// each collection.
+extern size_t *__gc_alloc_ptr, *__gc_alloc_limit;
+
+
+// ============================================================================
+//                          GC static objects
+// ============================================================================
+// The X86 backend lays out string literals which are only read, as well as
+// s-expressions and arrays without fields and closures which capture nothing,
+// as preformatted objects in the read-only `lama_statics` section. They are
+// valid Lama values, but the GC treats them as immortal: they are never marked,
+// moved or fixed up (none of them refers to the heap).
+
+
+// ============================================================================
+//                        GC large object space
+// ============================================================================
+// Objects of at least LARGE_OBJECT_THRESHOLD bytes are not allocated in the
+// heap: each of them gets its own mapping and is never moved by compaction.
+// Large objects are kept in an array sorted by address. They are marked by
+// major collections only (their fields are traced after the marking queue is
+// drained, since the queue is threaded through the heap) and the dead ones are
+// unmapped after compaction. Minor collections treat all large objects as old,
+// fields of the ones allocated since the last collection are scanned as roots,
+// later stores into them are recorded by the write barrier.
+// A major collection is forced once the space allocated for large objects
+// since the last one exceeds both the heap size and LARGE_OBJECT_SPACE_TRIGGER.
+#ifdef DEBUG_VERSION
+#  define LARGE_OBJECT_THRESHOLD (1 << 8)
+#  define LARGE_OBJECT_SPACE_TRIGGER (1 << 12)
+#else
+// in bytes
+#  define LARGE_OBJECT_THRESHOLD (1 << 16)
+#  define LARGE_OBJECT_SPACE_TRIGGER (1 << 24)
+#endif
+#define INIT_LARGE_OBJECT_SPACE_CAPACITY 16
+
+typedef struct {
+  size_t *begin;   // object header
+  size_t  size;    // size of the mapping in bytes
+  int     marked;
+  int     young;   // allocated since the last collection
+} large_object;
+
+typedef struct {
+  size_t        current_free;
+  size_t        capacity;
+  size_t        allocated_since_gc;   // in bytes
+  large_object *objects;
+} large_object_space;
+
+// allocates an object of the given size (in bytes) in its own mapping
+void *alloc_large_object (size_t size);
+// checks if p points to the content of a large object
+bool is_large_object (const size_t *p);
+// unmaps large objects which were not marked and unmarks the rest
+void sweep_large_objects (void);
+#ifdef DEBUG_VERSION
+size_t large_objects_number (void);
+#endif
+
+
+// ============================================================================
+//                          GC parallel marking
+// ============================================================================
+// The number of GC threads is taken from LAMA_GC_THREADS environment variable
+// during `__init` (1 by default, i.e. sequential marking). With several threads
+// a major collection of a big enough heap is marked in parallel: roots (stack,
+// extra roots, global area, remembered set) are partitioned between workers,
+// each worker traces objects with its own Chase-Lev work-stealing deque and
+// steals from others when it runs out of work. Mark bits are set atomically
+// when an object is pushed, so every object is scanned exactly once and the
+// enqueued-bit is not used at all.
+#define MAX_GC_THREADS 64
+#define INIT_MARK_DEQUE_CAPACITY 1024
+#ifdef DEBUG_VERSION
+#  define PARALLEL_GC_THRESHOLD 0
+#else
+// minimal heap size (in words) for which parallel marking and compaction pay off
+#  define PARALLEL_GC_THRESHOLD (1 << 20)
+#endif
+
+typedef struct mark_deque_buffer {
+  long                      capacity;   // always a power of two
+  struct mark_deque_buffer *retired;    // previous buffer, it may still be read by thieves
+  void                     *objects[];
+} mark_deque_buffer;
+
+typedef struct {
+  int                id;
+  unsigned int       seed;   // for choosing victims to steal from
+  long               top;    // thieves' end
+  long               bottom;   // owner's end
+  mark_deque_buffer *buffer;
+} mark_worker;
+
+
+// ============================================================================
+//                        GC parallel compaction
+// ============================================================================
+// The heap is split into regions of fixed size, an object belongs to the region
+// its header lies in. LISP2 passes are done region by region by several GC
+// threads: marked words of regions are counted and summed up, references are
+// fixed in parallel, and a region is moved as soon as all the lower regions
+// overlapping its destination have been moved. The resulting layout is exactly
+// the same as after sequential compaction.
+// Regions are aligned to the words of the side bitmaps.
+#ifdef DEBUG_VERSION
+#  define COMPACTION_REGION_SIZE (1 << 6)
+#else
+// in words
+#  define COMPACTION_REGION_SIZE (1 << 15)
+#endif
+
+typedef struct {
+  size_t marked_words;   // number of marked words in the region, then the number of those before it
+  size_t live_size;      // total size (in words) of live objects of the region
+  size_t destination;    // offset the first live object of the region is moved to
+  size_t source_begin;   // offset of the first live object of the region
+  size_t source_end;     // offset of the end of the last live object of the region
+  int    relocated;
+} compaction_region;
+
+size_t parallel_compute_locations (void);
+void   parallel_update_references (void);
+void   parallel_physically_relocate (void);
+
+
+// ============================================================================
+//                          GC side bitmaps
+// ============================================================================
+// Both bitmaps have one bit per heap word:
+//  - the mark bitmap has bits of all the words of each live object set,
+//  - the object-start bitmap has bits of object headers set, it is maintained
+//    by `alloc` and rebuilt after compaction.
+// Live objects are thus found without touching headers of dead ones, and the
+// new location of a live object is the number of marked words before it, which
+// is computed from a per-word prefix sum and a popcount.
+#define BITMAP_WORD_BITS (sizeof(size_t) * 8)
+
+
 // ============================================================================
 //                   Implemented in GASM: see gc_runtime.s
 // ============================================================================
@@ -163,12 +409,12 @@ void set_extra_roots (size_t extra_roots_size, void **extra_roots_ptr);
 // ============================================================================
 // accepts pointer to the start of the region and to the end of the region
 // scans it and if it meets a pointer, it should be modified in according to forward address
-void scan_and_fix_region (memory_chunk *old_heap, void *start, void *end);
+void scan_and_fix_region (void *start, void *end);
 
-// takes a pointer to an object content as an argument, returns forwarding address
+// takes a pointer to an object content as an argument, returns value of the forward address field
 size_t get_forward_address (void *obj);
 
-// takes a pointer to an object content as an argument, sets forwarding address to value 'addr'
+// takes a pointer to an object content as an argument, sets forward address field to value 'addr'
 void set_forward_address (void *obj, size_t addr);
 
 // takes a pointer to an object content as an argument, returns whether this object was marked as live
@@ -781,20 +781,15 @@ extern void *Lstring (void *p) {
 }
 
 extern void *Bclosure (int bn, void *entry, ...) {
-  va_list       args;
-  int           i, ai;
-  register int *ebp asm("ebp");
-  size_t       *argss;
-  data         *r;
-  int           n = UNBOX(bn);
+  va_list args;
+  int     i, ai;
+  data   *r;
+  int     n = UNBOX(bn);
 
   PRE_GC();
 
-  argss = (ebp + 12);
-  for (i = 0; i < n; i++, argss++) { push_extra_root((void **)argss); }
-
-  r = (data *)alloc_closure(n + 1);
-  push_extra_root((void **)&r);
+  // the captured values are pushed by the caller, its stack map keeps them alive
+  r                         = (data *)alloc_closure(n + 1);
   ((void **)r->contents)[0] = entry;
 
   va_start(args, entry);
@@ -807,13 +802,22 @@ extern void *Bclosure (int bn, void *entry, ...) {
   va_end(args);
 
   POST_GC();
-
-  pop_extra_root((void **)&r);
-  argss--;
-  for (i = 0; i < n; i++, argss--) { pop_extra_root((void **)argss); }
   return r->contents;
 }
 
+// the slow path of the inline allocation (see `GC inline allocation` in gc.h):
+// allocates zeroed bn bytes and returns a pointer to the header, which is filled by the caller
+extern void *Balloc (int bn) {
+  void *r;
+
+  PRE_GC();
+
+  r = alloc(UNBOX(bn));
+
+  POST_GC();
+  return r;
+}
+
 extern void *Barray (int bn, ...) {
   va_list args;
   int     i, ai;
@@ -952,19 +956,29 @@ extern void *Bsta (void *v, int i, void *x) {
       }
       case SEXP_TAG: {
         ((int *)x)[UNBOX(i) + 1] = (int)v;
+        gc_write_barrier(&((void **)x)[UNBOX(i) + 1], v);
         break;
       }
       default: {
         ((int *)x)[UNBOX(i)] = (int)v;
+        gc_write_barrier(&((void **)x)[UNBOX(i)], v);
       }
     }
   } else {
     *(void **)x = v;
+    gc_write_barrier((void **)x, v);
   }
 
   return v;
 }
 
+extern void *Bsti (void *v, void **x) {
+  *x = v;
+  gc_write_barrier(x, v);
+
+  return v;
+}
+
 static void fix_unboxed (char *s, va_list va) {
   size_t *p = (size_t *)va;
   int     i = 0;
@@ -1131,17 +1145,21 @@ extern void Lfclose (FILE *f) {
 extern void *LreadLine () {
   char *buf;
 
+  PRE_GC();
+
   if (scanf("%m[^\n]", &buf) == 1) {
     void *s = Bstring(buf);
 
     getchar();
 
     free(buf);
+    POST_GC();
     return s;
   }
 
   if (errno != 0) failure("readLine (): %s\n", strerror(errno));
 
+  POST_GC();
   return (void *)BOX(0);
 }
 
@@ -1150,6 +1168,8 @@ extern void *Lfread (char *fname) {
 
   ASSERT_STRING("fread", fname);
 
+  PRE_GC();
+
   f = fopen(fname, "r");
 
   if (f && fseek(f, 0l, SEEK_END) >= 0) {
@@ -1160,6 +1180,7 @@ extern void *Lfread (char *fname) {
 
     if (fread(s, 1, size, f) == size) {
       fclose(f);
+      POST_GC();
       return s;
     }
   }
@@ -1258,7 +1279,12 @@ extern void set_args (int argc, char *argv[]) {
   p = LmakeArray(BOX(n));
   push_extra_root((void **)&p);
 
-  for (i = 0; i < n; i++) { ((int *)p)[i] = (int)Bstring(argv[i]); }
+  for (i = 0; i < n; i++) {
+    // p may be promoted to the old space while the string is being allocated
+    void *s       = Bstring(argv[i]);
+    ((int *)p)[i] = (int)s;
+    gc_write_barrier((void **)&((int *)p)[i], s);
+  }
 
   pop_extra_root((void **)&p);
   POST_GC();
@@ -1,36 +1,42 @@
 #ifndef __LAMA_RUNTIME_COMMON__
 #define __LAMA_RUNTIME_COMMON__
 #include <stddef.h>
+#include <stdint.h>
 
 // this flag makes GC behavior a bit different for testing purposes.
 //#define DEBUG_VERSION
 //#define FULL_INVARIANT_CHECKS
 
+// the machine word Lama values (boxed integers, pointers and object headers) are
+// kept in, the runtime is built for the 32-bit target only
+typedef int32_t  aint;
+typedef uint32_t auint;
+
 #define STRING_TAG 0x00000001
 #define ARRAY_TAG 0x00000003
 #define SEXP_TAG 0x00000005
 #define CLOSURE_TAG 0x00000007
 #define UNBOXED_TAG 0x00000009   // Not actually a data_header; used to return from LkindOf
 
-#define LEN(x) ((x & 0xFFFFFFF8) >> 3)
+#define LEN(x) (((auint)(x)) >> 3)
 #define TAG(x) (x & 0x00000007)
 
-#define SEXP_ONLY_HEADER_SZ (sizeof(int))
+#define SEXP_ONLY_HEADER_SZ (sizeof(aint))
 
 #ifndef DEBUG_VERSION
-#  define DATA_HEADER_SZ (sizeof(size_t) + sizeof(int))
+#  define DATA_HEADER_SZ (sizeof(size_t) + sizeof(aint))
 #else
-#  define DATA_HEADER_SZ (sizeof(size_t) + sizeof(size_t) + sizeof(int))
+#  define DATA_HEADER_SZ (sizeof(size_t) + sizeof(size_t) + sizeof(aint))
 #endif
 
-#define MEMBER_SIZE sizeof(int)
+#define MEMBER_SIZE sizeof(aint)
 
 #define TO_DATA(x) ((data *)((char *)(x)-DATA_HEADER_SZ))
 #define TO_SEXP(x) ((sexp *)((char *)(x)-DATA_HEADER_SZ))
 
-#define UNBOXED(x) (((int)(x)) & 0x0001)
-#define UNBOX(x) (((int)(x)) >> 1)
-#define BOX(x) ((((int)(x)) << 1) | 0x0001)
+#define UNBOXED(x) (((aint)(x)) & 0x0001)
+#define UNBOX(x) (((aint)(x)) >> 1)
+#define BOX(x) ((((aint)(x)) << 1) | 0x0001)
 
 #define BYTES_TO_WORDS(bytes) (((bytes)-1) / sizeof(size_t) + 1)
 #define WORDS_TO_BYTES(words) ((words) * sizeof(size_t))
@@ -42,14 +48,14 @@
 typedef struct {
   // store tag in the last three bits to understand what structure this is, other bits are filled with
   // other utility info (i.e., size for array, number of fields for s-expression)
-  int data_header;
+  aint data_header;
 
 #ifdef DEBUG_VERSION
   size_t id;
 #endif
 
-  // last bit is used as MARK-BIT, the rest are used to store address where object should move
-  // last bit can be used because due to alignment we can assume that last two bits are always 0's
+  // used by GC to link the marking queue (mark bits are kept in a side bitmap), bit 1 is ENQUEUED-BIT
+  // which can be used because due to alignment we can assume that last two bits are always 0's
   size_t forward_address;
   char   contents[0];
 } data;
@@ -57,17 +63,17 @@ typedef struct {
 typedef struct {
   // store tag in the last three bits to understand what structure this is, other bits are filled with
   // other utility info (i.e., size for array, number of fields for s-expression)
-  int data_header;
+  aint data_header;
 
 #ifdef DEBUG_VERSION
   size_t id;
 #endif
 
-  // last bit is used as MARK-BIT, the rest are used to store address where object should move
-  // last bit can be used because due to alignment we can assume that last two bits are always 0's
+  // used by GC to link the marking queue (mark bits are kept in a side bitmap), bit 1 is ENQUEUED-BIT
+  // which can be used because due to alignment we can assume that last two bits are always 0's
   size_t forward_address;
-  int    tag;
-  int    contents[0];
+  aint   tag;
+  aint   contents[0];
 } sexp;
 
 #endif
@@ -15,6 +15,8 @@ extern void *Bsexp (int n, ...);
 extern void *Barray (int bn, ...);
 extern void *Bstring (void *);
 extern void *Bclosure (int bn, void *entry, ...);
+extern void *Bsta (void *v, int i, void *x);
+extern void *LmakeArray (int length);
 
 extern size_t __gc_stack_top, __gc_stack_bottom;
 
@@ -61,6 +63,12 @@ void force_gc_cycle (virt_stack *st) {
   __gc_stack_top = 0;
 }
 
+void force_minor_gc_cycle (virt_stack *st) {
+  __gc_stack_top = (size_t)vstack_top(st) - 4;
+  minor_gc();
+  __gc_stack_top = 0;
+}
+
 void test_simple_string_alloc (void) {
   virt_stack *st = init_test();
 
@@ -193,6 +201,196 @@ void test_small_tree_compaction (void) {
   cleanup_test(st);
 }
 
+extern memory_chunk heap;
+
+void test_heap_does_not_move_on_growth (void) {
+  virt_stack *st    = init_test();
+  size_t     *begin = heap.begin;
+  size_t      size  = heap.size;
+
+  const int N = 100;
+  for (int i = 0; i < N; ++i) {
+    vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, "alive"));
+  }
+  force_gc_cycle(st);
+
+  int ids[N];
+  assert((objects_snapshot(ids, N) == N));
+  assert((heap.size > size));
+  assert((heap.begin == begin));
+
+  cleanup_test(st);
+}
+
+void test_heap_shrinks_when_live_data_drops (void) {
+  virt_stack *st = init_test();
+
+  const int N = 100;
+  for (int i = 0; i < N; ++i) {
+    vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, "alive"));
+  }
+  force_gc_cycle(st);
+  size_t size = heap.size;
+
+  for (int i = 0; i < N; ++i) { vstack_pop(st); }
+  // hysteresis: the heap is kept for a couple of collections
+  for (int i = 0; i < HEAP_SHRINK_DELAY - 1; ++i) {
+    force_gc_cycle(st);
+    assert((heap.size == size));
+  }
+  force_gc_cycle(st);
+  assert((heap.size < size));
+
+  cleanup_test(st);
+}
+
+void test_minor_gc_promotes_survivors (void) {
+  virt_stack *st = init_test();
+
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, "survivor"));
+  call_runtime_function(vstack_top(st) - 4, Bstring, 1, "garbage");
+
+  force_minor_gc_cycle(st);
+
+  const int N = 10;
+  int       ids[N];
+  size_t    alive = objects_snapshot(ids, N);
+  assert((alive == 1));
+  assert((strcmp((char *)vstack_kth_from_start(st, 0), "survivor") == 0));
+
+  cleanup_test(st);
+}
+
+void test_write_barrier_keeps_young_objects_alive (void) {
+  virt_stack *st = init_test();
+
+  // allocate array [ BOX(1) ] and promote it to the old space
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Barray, 2, BOX(1), BOX(1)));
+  force_minor_gc_cycle(st);
+
+  // the only reference to the young string is stored into the old array
+  size_t s = call_runtime_function(vstack_top(st) - 4, Bstring, 1, "young");
+  call_runtime_function(vstack_top(st) - 4, Bsta, 3, s, BOX(0), vstack_kth_from_start(st, 0));
+  force_minor_gc_cycle(st);
+
+  const int N = 10;
+  int       ids[N];
+  size_t    alive = objects_snapshot(ids, N);
+  assert((alive == 2));
+  assert((strcmp(((char **)vstack_kth_from_start(st, 0))[0], "young") == 0));
+
+  cleanup_test(st);
+}
+
+void test_inline_allocated_objects_survive_collection (void) {
+  virt_stack *st = init_test();
+
+  assert((__gc_alloc_ptr < __gc_alloc_limit));
+  assert((__gc_alloc_limit <= __gc_alloc_ptr + NURSERY_CAPACITY));
+  // allocate array [ BOX(5) ] the way generated code does, i.e. bypassing alloc
+  data *obj = (data *)__gc_alloc_ptr;
+  __gc_alloc_ptr += BYTES_TO_WORDS(array_size(1));
+  obj->data_header          = ARRAY_TAG | (1 << 3);
+  obj->forward_address      = 0;
+  obj->id                   = 0;
+  ((int *)obj->contents)[0] = BOX(5);
+  vstack_push(st, (size_t)obj->contents);
+  call_runtime_function(vstack_top(st) - 4, Bstring, 1, "garbage");
+
+  force_minor_gc_cycle(st);
+
+  assert((((int *)vstack_kth_from_start(st, 0))[0] == BOX(5)));
+  assert((__gc_alloc_limit == MIN(heap.end, __gc_alloc_ptr + NURSERY_CAPACITY)));
+
+  cleanup_test(st);
+}
+
+// a stand-in for a string literal laid out by the X86 backend, see `GC static objects` in gc.h
+static size_t static_string[8] __attribute__((section("lama_statics")));
+
+void test_static_objects_are_immortal (void) {
+  virt_stack *st = init_test();
+
+  data *s            = (data *)static_string;
+  s->data_header     = STRING_TAG | (6 << 3);
+  s->forward_address = 0;
+  strcpy(s->contents, "static");
+  assert((is_valid_heap_pointer((size_t *)s->contents)));
+
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Barray, 2, BOX(1), s->contents));
+  force_minor_gc_cycle(st);
+  force_gc_cycle(st);
+
+  assert((((char **)vstack_kth_from_start(st, 0))[0] == s->contents));
+  assert((s->forward_address == 0));
+  assert((strcmp(s->contents, "static") == 0));
+
+  cleanup_test(st);
+}
+
+void test_large_objects_are_not_moved (void) {
+  virt_stack *st = init_test();
+
+  char large[LARGE_OBJECT_THRESHOLD];
+  memset(large, 'a', sizeof(large) - 1);
+  large[sizeof(large) - 1] = 0;
+  call_runtime_function(vstack_top(st) - 4, Bstring, 1, "garbage");
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, large));
+  size_t s = vstack_kth_from_start(st, 0);
+  assert((is_large_object((size_t *)s)));
+
+  // the small string is collected, the large one stays in place
+  force_gc_cycle(st);
+  const int N = 10;
+  int       ids[N];
+  assert((objects_snapshot(ids, N) == 0));
+  assert((vstack_kth_from_start(st, 0) == s));
+  assert((large_objects_number() == 1));
+  assert((strcmp((char *)s, large) == 0));
+
+  vstack_pop(st);
+  force_gc_cycle(st);
+  assert((large_objects_number() == 0));
+
+  cleanup_test(st);
+}
+
+void test_large_object_fields_keep_young_objects_alive (void) {
+  virt_stack *st = init_test();
+
+  size_t n = LARGE_OBJECT_THRESHOLD / sizeof(size_t);
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, LmakeArray, 1, BOX(n)));
+  assert((is_large_object((size_t *)vstack_kth_from_start(st, 0))));
+
+  // a young large array is scanned by the minor collection
+  size_t s = call_runtime_function(vstack_top(st) - 4, Bstring, 1, "first");
+  call_runtime_function(vstack_top(st) - 4, Bsta, 3, s, BOX(0), vstack_kth_from_start(st, 0));
+  force_minor_gc_cycle(st);
+
+  // an old one is covered by the write barrier
+  s = call_runtime_function(vstack_top(st) - 4, Bstring, 1, "second");
+  call_runtime_function(vstack_top(st) - 4, Bsta, 3, s, BOX(n - 1), vstack_kth_from_start(st, 0));
+  force_minor_gc_cycle(st);
+
+  const int N = 10;
+  int       ids[N];
+  size_t    alive = objects_snapshot(ids, N);
+  assert((alive == 2));
+  char **fields = (char **)vstack_kth_from_start(st, 0);
+  assert((strcmp(fields[0], "first") == 0));
+  assert((strcmp(fields[n - 1], "second") == 0));
+
+  // the minor collections above ran with an empty old space, a major one still traces the fields
+  force_gc_cycle(st);
+  alive = objects_snapshot(ids, N);
+  assert((alive == 2));
+  fields = (char **)vstack_kth_from_start(st, 0);
+  assert((strcmp(fields[0], "first") == 0));
+  assert((strcmp(fields[n - 1], "second") == 0));
+
+  cleanup_test(st);
+}
+
 extern size_t cur_id;
 
 size_t generate_random_obj_forest (virt_stack *st, int cnt, int seed) {
@@ -246,6 +444,12 @@ void run_stress_test_random_obj_forest (int seed) {
   cleanup_test(st);
 }
 
+void test_parallel_gc (void) {
+  setenv("LAMA_GC_THREADS", "4", 1);
+  for (int s = 0; s < 10; ++s) { run_stress_test_random_obj_forest(s); }
+  unsetenv("LAMA_GC_THREADS");
+}
+
 #endif
 
 #include <time.h>
@@ -262,6 +466,14 @@ int main (int argc, char **argv) {
   test_garbage_is_reclaimed();
   test_alive_are_not_reclaimed();
   test_small_tree_compaction();
+  test_heap_does_not_move_on_growth();
+  test_heap_shrinks_when_live_data_drops();
+  test_minor_gc_promotes_survivors();
+  test_write_barrier_keeps_young_objects_alive();
+  test_inline_allocated_objects_survive_collection();
+  test_static_objects_are_immortal();
+  test_large_objects_are_not_moved();
+  test_large_object_fields_keep_young_objects_alive();
 
   time_t start, end;
   double diff;
@@ -271,5 +483,7 @@ int main (int argc, char **argv) {
   time(&end);
   diff = difftime(end, start);
   printf("Stress tests took %.2lf seconds to complete\n", diff);
+
+  test_parallel_gc();
 #endif
 }
@@ -5,6 +5,7 @@ class options args =
   let dump_ast = 0b1 in
   let dump_sm = 0b010 in
   let dump_source = 0b100 in
+  let dump_opt = 0b1000 in
   (* Kakadu: binary masks are cool for C code, but for OCaml I don't see any reason to save memory like this *)
   let help_string =
     "Lama compiler. (C) JetBrains Reserach, 2017-2020.\n"
@@ -22,6 +23,10 @@ class options args =
        into .sm file; has no\n"
     ^ "                effect if -i option is specfied)\n"
     ^ "  -b        --- compile to a stack machine bytecode\n"
+    ^ "  -O<n>     --- set the stack machine optimization level (0, 1 or 2; 1 \
+       by default)\n"
+    ^ "  -do       --- dump optimizer statistics (the output will be written \
+       into .ostat file)\n"
     ^ "  -v        --- show version\n" ^ "  -h        --- show this help\n"
   in
   object (self)
@@ -34,6 +39,7 @@ class options args =
     val mode = ref (`Default : [ `Default | `Eval | `SM | `Compile | `BC ])
     val curdir = Unix.getcwd ()
     val debug = ref false
+    val opt_level = ref 1
 
     (* Workaround until Ostap starts to memoize properly *)
     val const = ref false
@@ -67,6 +73,10 @@ class options args =
           | "-ds" -> self#set_dump dump_sm
           | "-dsrc" -> self#set_dump dump_source
           | "-dp" -> self#set_dump dump_ast
+          | "-do" -> self#set_dump dump_opt
+          | "-O0" -> opt_level := 0
+          | "-O1" -> opt_level := 1
+          | "-O2" -> opt_level := 2
           | "-h" -> self#set_help
           | "-v" -> self#set_version
           | "-g" -> self#set_debug
@@ -137,6 +147,7 @@ class options args =
       | Some name -> name
 
     method get_help = !help
+    method get_opt_level = !opt_level
     method get_include_paths = !paths
 
     method basename =
@@ -170,6 +181,9 @@ class options args =
       if !dump land dump_sm > 0 then self#dump_file "sm" (SM.show_prg sm)
       else ()
 
+    method dump_opt stats =
+      if !dump land dump_opt > 0 then self#dump_file "ostat" stats else ()
+
     method greet =
       (match !outfile with
       | None -> ()
@@ -184,6 +198,37 @@ class options args =
     method set_debug = debug := true
   end
 
+(* Compiles the units the main program imports (transitively) to SM code
+   for linking into one bytecode image; returns them in initialization order *)
+let bytecode_units cmd ((imports, _), _) =
+  let paths = cmd#get_include_paths in
+  let rec visit (seen, units) import =
+    if import = "Std" || List.mem import seen then (seen, units)
+    else
+      let path, _ = Language.Interface.find import paths in
+      let source = Filename.concat path (import ^ ".lama") in
+      if not (Sys.file_exists source) then
+        raise
+          (Commandline_error
+             (Printf.sprintf "Source file for import \"%s\" not found" import));
+      let ucmd =
+        new options
+          (Array.of_list
+             ((Sys.argv.(0) :: "-c"
+              :: Printf.sprintf "-O%d" cmd#get_opt_level
+              :: List.concat_map (fun p -> [ "-I"; p ]) (List.rev paths))
+             @ [ source ]))
+      in
+      match Language.run_parser ucmd with
+      | `Ok uprog ->
+          let seen, units =
+            List.fold_left visit (import :: seen, units) (fst @@ fst uprog)
+          in
+          (seen, units @ [ (import, SM.compile ucmd uprog) ])
+      | `Fail er -> raise (Language.Semantic_error er)
+  in
+  snd @@ List.fold_left visit ([], []) imports
+
 let[@ocaml.warning "-32"] main =
   try
     let cmd = new options Sys.argv in
@@ -197,7 +242,10 @@ let[@ocaml.warning "-32"] main =
         cmd#dump_source (snd prog);
         match cmd#get_mode with
         | `Default | `Compile -> ignore @@ X86.build cmd prog
-        | `BC -> SM.ByteCode.compile cmd (SM.compile cmd prog)
+        | `BC ->
+            SM.ByteCode.compile cmd
+              (SM.ByteCode.link
+                 (("main", SM.compile cmd prog) :: bytecode_units cmd prog))
         | _ ->
             let rec read acc =
               try
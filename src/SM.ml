@@ -63,6 +63,8 @@ type insn =
   | PCALLC of int * bool
   (* calls a closure                           *)
   | CALLC of int * bool
+  (* calls a closure of a known function       *)
+  | KCALLC of string * int * bool
   (* calls a function/procedure                *)
   | CALL of string * int * bool
   (* returns from a function                   *)
@@ -94,6 +96,33 @@ type insn =
 (* The type for the stack machine program *)
 type prg = insn list [@@deriving gt ~options:{ show }]
 
+(* Builtins which only read their arguments and never keep them *)
+let read_only_builtins =
+  [
+    "Lprintf"; "Lfprintf"; "Lsprintf"; "Lfailure"; "Lstring"; "Llength";
+    "Lcompare"; "Lhash"; "LstringInt"; "Lsubstring";
+  ]
+
+(* Checks if the value pushed right before the given code is only read, i.e.
+   it is dropped, matched against or passed to a read-only builtin, and is
+   neither stored nor compared by address; only straight-line code is
+   looked through. Such a value (a string literal) may be shared *)
+let read_only_value code =
+  let rec inner d = function
+    | (LINE _ | SLABEL _) :: code -> inner d code
+    | (CONST _ | STRING _ | LD _ | CLOSURE _) :: code -> inner (d + 1) code
+    | DUP :: code -> d > 0 && inner (d + 1) code
+    | DROP :: code -> d = 0 || inner (d - 1) code
+    | ST _ :: code -> d > 0 && inner d code
+    | (PATT StrCmp | ELEM) :: code -> d <= 1 || inner (d - 1) code
+    | BINOP _ :: code -> d > 1 && inner (d - 1) code
+    | CALL (f, n, _) :: code ->
+        if d < n then List.mem f read_only_builtins else inner (d - n + 1) code
+    | SEXP (_, n) :: code -> d >= n && inner (d - n + 1) code
+    | _ -> false
+  in
+  inner 0 code
+
 module ByteCode = struct
   module M = Map.Make (String)
   module S = Set.Make (String)
@@ -159,13 +188,121 @@ module ByteCode = struct
        87 PATT
        39 STA
        16 FLABEL
+
+     The counts are per instruction, not per sequence, and the superinstructions
+     below are a fixed set rather than one derived from a profile of adjacent
+     pairs. Each of them is a shape the compiler emits itself:
+
+     - LD x; LD y; BINOP op: the operands of a binary operator are compiled
+       right before it, so any operator on two variables (loop conditions like
+       i < n, arithmetic on locals) is exactly this sequence;
+     - CONST n; BINOP op: an operator with a literal right operand (i + 1,
+       n - 1, x == 0) and every constant pattern, which compiles to
+       CONST c; BINOP "==";
+     - DUP; TAG s n; CJMP nz l: the test of every S-expression pattern, both in
+       pattern and in the case dispatch, so each TAG above is one of these;
+     - DROP; JMP l: the failure exit of the same test, which drops the
+       scrutinee and goes to the next branch.
+
+     Sequences interrupted by a label are never fused, so no jump can land
+     inside a superinstruction.
   *)
 
+  (* Links separately compiled units into one program. [units] are pairs of
+     a unit name and its code, the main unit first and the imported ones in
+     initialization order. Labels and globals private to a unit are renamed
+     apart, the initializers are called from the prologue of main, and the
+     functions unreachable from main and the initializers are dropped *)
+  let link units =
+    let inits = List.map (fun (name, _) -> "init" ^ name) @@ List.tl units in
+    let rename (name, prg) =
+      let publics =
+        List.fold_left
+          (fun s -> function PUBLIC l | EXTERN l -> S.add l s | _ -> s)
+          S.empty prg
+      in
+      let defined =
+        List.fold_left
+          (fun s -> function
+            | LABEL l | SLABEL l | FLABEL l -> S.add l s
+            | _ -> s)
+          S.empty prg
+      in
+      let lab l =
+        if S.mem l defined && not (S.mem l publics) then l ^ "." ^ name else l
+      in
+      let des = function
+        | Value.Global x when not (S.mem ("global_" ^ x) publics) ->
+            Value.Global (x ^ "." ^ name)
+        | d -> d
+      in
+      List.map
+        (function
+          | LABEL l -> LABEL (lab l)
+          | SLABEL l -> SLABEL (lab l)
+          | FLABEL l -> FLABEL (lab l)
+          | JMP l -> JMP (lab l)
+          | CJMP (c, l) -> CJMP (c, lab l)
+          | CALL (f, n, t) -> CALL (lab f, n, t)
+          | KCALLC (f, n, t) -> KCALLC (lab f, n, t)
+          | CLOSURE (f, ds) -> CLOSURE (lab f, List.map des ds)
+          | BEGIN (f, a, l, c, args, s) ->
+              BEGIN (f, a, l, List.map des c, args, s)
+          | LD d -> LD (des d)
+          | LDA d -> LDA (des d)
+          | ST d -> ST (des d)
+          | insn -> insn)
+        prg
+    in
+    (* split into declarations and functions, each starting with LABEL; BEGIN *)
+    let rec split decls funs = function
+      | [] ->
+          (List.rev decls, List.rev_map (fun (f, c) -> (f, List.rev c)) funs)
+      | (LABEL f as l) :: (BEGIN _ as b) :: prg ->
+          split decls ((f, [ b; l ]) :: funs) prg
+      | insn :: prg -> (
+          match funs with
+          | [] -> split (insn :: decls) funs prg
+          | (f, c) :: funs' -> split decls ((f, insn :: c) :: funs') prg)
+    in
+    let units = List.map (fun u -> split [] [] @@ rename u) units in
+    let decls = List.concat_map fst units in
+    let funs = List.concat_map snd units in
+    let rec reach live = function
+      | [] -> live
+      | f :: fs when S.mem f live -> reach live fs
+      | f :: fs -> (
+          match List.assoc_opt f funs with
+          | None -> reach live fs
+          | Some code ->
+              reach (S.add f live)
+                (List.fold_left
+                   (fun fs -> function
+                     | CALL (g, _, _) | CLOSURE (g, _) -> g :: fs
+                     | _ -> fs)
+                   fs code))
+    in
+    let live = reach S.empty ("main" :: inits) in
+    List.filter (function PUBLIC l -> S.mem l live | _ -> false) decls
+    @ List.concat_map
+        (fun (f, code) ->
+          if not (S.mem f live) then []
+          else if f = "main" then
+            match code with
+            | l :: b :: code ->
+                l :: b
+                :: List.concat_map (fun i -> [ CALL (i, 0, false); DROP ]) inits
+                @ code
+            | _ -> code
+          else code)
+        funs
+
   let compile cmd insns =
     (* let word_size          = 4                                                                                   in *)
     let code = Buffer.create 256 in
     let st = StringTab.create () in
     let lmap = Stdlib.ref M.empty in
+    let lines = Stdlib.ref [] in
     let pubs = Stdlib.ref S.empty in
     let imports = Stdlib.ref S.empty in
     let globals = Stdlib.ref M.empty in
@@ -291,7 +428,7 @@ module ByteCode = struct
           add_ints [ 0; List.length ds ];
           add_designations None ds
       (* 0x55 n:32            *)
-      | CALLC (n, _) ->
+      | CALLC (n, _) | KCALLC (_, n, _) ->
           add_bytes [ (5 * 16) + 5 ];
           add_ints [ n ]
       (* 0x56 l:32 n:32       *)
@@ -314,6 +451,7 @@ module ByteCode = struct
           add_ints [ l; c ]
       (* 0x5a n:32            *)
       | LINE n ->
+          lines := (Buffer.length code, n) :: !lines;
           add_bytes [ (5 * 16) + 10 ];
           add_ints [ n ]
       (* 0x6p                 *)
@@ -325,7 +463,43 @@ module ByteCode = struct
           failwith
             (Printf.sprintf "Unexpected pattern: %s: %d" __FILE__ __LINE__)
     in
-    List.iter insn_code insns;
+    let rec iterate = function
+      | [] -> ()
+      (* 0x1c s:32            *)
+      (* a string literal which is only read, see read_only_value *)
+      | STRING s :: insns when read_only_value insns ->
+          add_bytes [ (1 * 16) + 12 ];
+          add_strings [ s ];
+          iterate insns
+      (* 0x8o d1:8 n1:32 d2:8 n2:32 *)
+      | LD x :: LD y :: BINOP op :: insns ->
+          add_bytes [ (8 * 16) + opnum op ];
+          add_designations None [ x; y ];
+          iterate insns
+      (* 0x9o n:32                  *)
+      | CONST n :: BINOP op :: insns ->
+          add_bytes [ (9 * 16) + opnum op ];
+          add_ints [ n ];
+          iterate insns
+      (* 0xa0 s:32 n:32 l:32        *)
+      | DUP :: TAG (s, n) :: CJMP ("nz", l) :: insns ->
+          add_bytes [ (10 * 16) + 0 ];
+          add_strings [ s ];
+          add_ints [ n ];
+          add_fixup l;
+          add_ints [ 0 ];
+          iterate insns
+      (* 0xa1 l:32                  *)
+      | DROP :: JMP l :: insns ->
+          add_bytes [ (10 * 16) + 1 ];
+          add_fixup l;
+          add_ints [ 0 ];
+          iterate insns
+      | insn :: insns ->
+          insn_code insn;
+          iterate insns
+    in
+    iterate insns;
     add_bytes [ 255 ];
     let code = Buffer.to_bytes code in
     List.iter
@@ -347,23 +521,402 @@ module ByteCode = struct
               failwith (Printf.sprintf "ERROR: undefined label '%s'" l) ))
       @@ S.elements !pubs
     in
+    let imports =
+      List.map (fun l -> Int32.of_int @@ StringTab.add st l) @@ S.elements !imports
+    in
     let st = Buffer.to_bytes st.StringTab.buffer in
+    (* The image of version 2 (see byterun/byterun.c): a header, a section
+       table and 4-byte aligned sections, each with an FNV-1a checksum *)
+    let ints l =
+      let b = Buffer.create 64 in
+      List.iter (Buffer.add_int32_ne b) l;
+      Buffer.to_bytes b
+    in
+    let sections =
+      [
+        (1, st);
+        (2, ints @@ List.concat_map (fun (n, o) -> [ n; o ]) pubs);
+        (3, code);
+        ( 4,
+          ints
+          @@ List.concat_map (fun (o, l) -> [ Int32.of_int o; Int32.of_int l ])
+          @@ List.rev !lines );
+        (5, ints imports);
+      ]
+    in
+    let checksum b =
+      Bytes.fold_left
+        (fun h c -> (h lxor Char.code c) * 0x01000193 land 0xFFFFFFFF)
+        0x811c9dc5 b
+    in
+    let align n = (n + 3) land lnot 3 in
     let file = Buffer.create 1024 in
-    Buffer.add_int32_ne file (Int32.of_int @@ Bytes.length st);
+    Buffer.add_string file "LAMA";
+    Buffer.add_int32_ne file 2l;
     Buffer.add_int32_ne file (Int32.of_int @@ !glob_count);
-    Buffer.add_int32_ne file (Int32.of_int @@ List.length pubs);
+    Buffer.add_int32_ne file (Int32.of_int @@ List.length sections);
+    ignore
+    @@ List.fold_left
+         (fun ofs (kind, b) ->
+           Buffer.add_int32_ne file (Int32.of_int kind);
+           Buffer.add_int32_ne file (Int32.of_int ofs);
+           Buffer.add_int32_ne file (Int32.of_int @@ Bytes.length b);
+           Buffer.add_int32_ne file (Int32.of_int @@ checksum b);
+           align (ofs + Bytes.length b))
+         (16 + (16 * List.length sections))
+         sections;
     List.iter
-      (fun (n, o) ->
-        Buffer.add_int32_ne file n;
-        Buffer.add_int32_ne file o)
-      pubs;
-    Buffer.add_bytes file st;
-    Buffer.add_bytes file code;
+      (fun (_, b) ->
+        Buffer.add_bytes file b;
+        Buffer.add_string file
+          (String.make (align (Buffer.length file) - Buffer.length file) '\000'))
+      sections;
     let f = open_out_bin (Printf.sprintf "%s.bc" cmd#basename) in
     Buffer.output_buffer f file;
     close_out f
 end
 
+(* Stack machine optimizer
+
+     Optimizer.optimize : options -> prg -> prg
+
+   A pipeline of passes over the stack machine code, run right after it is
+   generated, so both the native and the bytecode backends (and the stack machine
+   interpreter) get optimized code. The level is set by -O0/-O1/-O2: -O1 runs the
+   local passes, -O2 adds the control flow ones. The passes are repeated until
+   nothing changes (or for a bounded number of rounds)
+*)
+module Optimizer = struct
+  module S = Set.Make (String)
+
+  (* the generated code computes on 31-bit integers; a constant is folded only
+     if the result is the same there *)
+  let min_value, max_value = (-(1 lsl 30), (1 lsl 30) - 1)
+  let fits n = min_value <= n && n <= max_value
+
+  let fold op x y =
+    let b c = if c then 1 else 0 in
+    match op with
+    | "+" -> Some (x + y)
+    | "-" -> Some (x - y)
+    | "*" -> Some (x * y)
+    | ("/" | "%") when y = 0 -> None
+    | "/" -> Some (x / y)
+    | "%" -> Some (x mod y)
+    | "<" -> Some (b (x < y))
+    | "<=" -> Some (b (x <= y))
+    | ">" -> Some (b (x > y))
+    | ">=" -> Some (b (x >= y))
+    | "==" -> Some (b (x = y))
+    | "!=" -> Some (b (x <> y))
+    | "&&" -> Some (b (x <> 0 && y <> 0))
+    | "!!" -> Some (b (x <> 0 || y <> 0))
+    | _ -> None
+
+  (* DUP/DROP and ST/LD pairs, pure pushes which are dropped, constant folding
+     of BINOP and CJMP over CONST, repeated LINEs *)
+  let rec peephole = function
+    | [] -> []
+    | DUP :: DROP :: code -> peephole code
+    | (CONST _ | STRING _ | LD _ | CLOSURE _) :: DROP :: code -> peephole code
+    | ST x :: DROP :: LD y :: code when x = y -> peephole (ST x :: code)
+    | LD x :: ST y :: code when x = y -> peephole (LD x :: code)
+    | CONST x :: CONST y :: BINOP op :: code -> (
+        match fold op x y with
+        | Some n when fits n -> peephole (CONST n :: code)
+        | _ -> CONST x :: peephole (CONST y :: BINOP op :: code))
+    | CONST n :: CJMP (c, l) :: code ->
+        if (n = 0) = (c = "z") then JMP l :: peephole code else peephole code
+    | LINE _ :: (LINE _ :: _ as code) -> peephole code
+    | insn :: code -> insn :: peephole code
+
+  (* collapses runs of scope labels into one, renaming the scopes of BEGINs *)
+  let scopes code =
+    let renames = Hashtbl.create 64 in
+    let rec collapse = function
+      | [] -> []
+      | SLABEL l :: SLABEL l' :: code ->
+          Hashtbl.replace renames l' l;
+          collapse (SLABEL l :: code)
+      | insn :: code -> insn :: collapse code
+    in
+    let code = collapse code in
+    let rec rename l =
+      match Hashtbl.find_opt renames l with Some l' -> rename l' | None -> l
+    in
+    let rec scope s =
+      {
+        s with
+        blab = rename s.blab;
+        elab = rename s.elab;
+        subs = List.map scope s.subs;
+      }
+    in
+    if Hashtbl.length renames = 0 then code
+    else
+      List.map
+        (function
+          | BEGIN (f, nargs, nlocals, closure, args, ss) ->
+              BEGIN (f, nargs, nlocals, closure, args, List.map scope ss)
+          | insn -> insn)
+        code
+
+  (* retargets jumps to unconditional jumps, drops jumps to the next
+     instruction *)
+  let threading code =
+    let rec skip = function
+      | (LABEL _ | FLABEL _ | SLABEL _ | LINE _) :: code -> skip code
+      | code -> code
+    in
+    (* the first instruction after each label which is not a label or LINE *)
+    let targets = Hashtbl.create 256 in
+    let rec index = function
+      | [] -> ()
+      | (LABEL l | FLABEL l) :: code ->
+          (match skip code with
+          | insn :: _ -> Hashtbl.replace targets l insn
+          | [] -> ());
+          index code
+      | _ :: code -> index code
+    in
+    index code;
+    let rec final seen l =
+      match Hashtbl.find_opt targets l with
+      | Some (JMP l') when not (S.mem l' seen) -> final (S.add l seen) l'
+      | _ -> l
+    in
+    let rec next l = function
+      | (LABEL l' | FLABEL l') :: _ when l = l' -> true
+      | (LABEL _ | FLABEL _ | SLABEL _ | LINE _) :: code -> next l code
+      | _ -> false
+    in
+    let rec inner = function
+      | [] -> []
+      | JMP l :: code ->
+          let l = final S.empty l in
+          if next l code then inner code else JMP l :: inner code
+      | CJMP (c, l) :: code -> CJMP (c, final S.empty l) :: inner code
+      | insn :: code -> insn :: inner code
+    in
+    inner code
+
+  (* removes the code of functions which is not reachable from their BEGINs
+     (keeping scope labels and ENDs), then labels no jump refers to *)
+  let reachable code =
+    let code = Array.of_list code in
+    let n = Array.length code in
+    let labels = Hashtbl.create 256 in
+    Array.iteri
+      (fun i -> function
+        | LABEL l | FLABEL l -> Hashtbl.replace labels l i | _ -> ())
+      code;
+    let live = Array.make n false in
+    let work = Stack.create () in
+    Array.iteri (fun i -> function BEGIN _ -> Stack.push i work | _ -> ()) code;
+    while not (Stack.is_empty work) do
+      let i = Stack.pop work in
+      if i < n && not live.(i) then (
+        live.(i) <- true;
+        match code.(i) with
+        | JMP l -> Stack.push (Hashtbl.find labels l) work
+        | CJMP (_, l) ->
+            Stack.push (Hashtbl.find labels l) work;
+            Stack.push (i + 1) work
+        | END -> ()
+        | _ -> Stack.push (i + 1) work)
+    done;
+    let jumps =
+      Array.fold_left
+        (fun (acc, i) insn ->
+          ( (match insn with
+            | (JMP l | CJMP (_, l)) when live.(i) -> S.add l acc
+            | _ -> acc),
+            i + 1 ))
+        (S.empty, 0) code
+      |> fst
+    in
+    let _, kept =
+      Array.fold_left
+        (fun ((inside, acc), i) insn ->
+          let keep =
+            (not inside)
+            ||
+            match insn with
+            | BEGIN _ | END | SLABEL _ -> true
+            | LABEL l | FLABEL l -> live.(i) && S.mem l jumps
+            | _ -> live.(i)
+          in
+          let inside =
+            match insn with BEGIN _ -> true | END -> false | _ -> inside
+          in
+          ((inside, if keep then insn :: acc else acc), i + 1))
+        ((false, []), 0) code
+      |> fst
+    in
+    List.rev kept
+
+  (* the maximal size of a function to inline, in instructions other than
+     labels and LINEs *)
+  let inline_budget = 20
+
+  (* splits the code of a function after BEGIN into the body and the rest *)
+  let body code =
+    let rec inner acc = function
+      | END :: code -> (List.rev acc, code)
+      | insn :: code -> inner (insn :: acc) code
+      | [] -> (List.rev acc, [])
+    in
+    inner [] code
+
+  (* inline expansion of small functions with no closure and no calls to the
+     functions of the program; the arguments are stored into fresh locals of
+     the caller, which all the bodies inlined into it share (they can not be
+     active at the same time since they make no calls to each other) *)
+  let inlining code =
+    let funs = Hashtbl.create 64 in
+    let rec collect = function
+      | [] -> ()
+      | BEGIN (f, nargs, nlocals, closure, _, _) :: code ->
+          let b, code = body code in
+          Hashtbl.replace funs f (nargs, nlocals, closure, b);
+          collect code
+      | _ :: code -> collect code
+    in
+    collect code;
+    let size b =
+      List.length
+        (List.filter
+           (function LINE _ | LABEL _ | FLABEL _ | SLABEL _ -> false | _ -> true)
+           b)
+    in
+    let inlinable = Hashtbl.create 64 in
+    Hashtbl.iter
+      (fun f (nargs, nlocals, closure, b) ->
+        if
+          closure = []
+          && size b <= inline_budget
+          && List.for_all
+               (function
+                 | CALL (g, _, _) | KCALLC (g, _, _) -> not (Hashtbl.mem funs g)
+                 | RET -> false
+                 | _ -> true)
+               b
+        then Hashtbl.replace inlinable f (nargs, nlocals, b))
+      funs;
+    (* labels of inlined bodies get a suffix which makes them distinct from
+       all the labels of the code, including those of the earlier rounds *)
+    let used = Hashtbl.create 1024 in
+    List.iter
+      (function
+        | LABEL l | FLABEL l | SLABEL l -> Hashtbl.replace used l ()
+        | _ -> ())
+      code;
+    let suffix = Stdlib.ref 0 in
+    let rec fresh b =
+      incr suffix;
+      let labels =
+        List.filter_map
+          (function
+            | LABEL l | FLABEL l -> Some (Printf.sprintf "%s_%d" l !suffix)
+            | _ -> None)
+          b
+      in
+      if List.exists (Hashtbl.mem used) labels then fresh b
+      else (
+        List.iter (fun l -> Hashtbl.replace used l ()) labels;
+        !suffix)
+    in
+    let expand base (nargs, nlocals, b) =
+      let n = fresh b in
+      let lab l = Printf.sprintf "%s_%d" l n in
+      let des = function
+        | Value.Arg i -> Value.Local (base + i)
+        | Value.Local i -> Value.Local (base + nargs + i)
+        | d -> d
+      in
+      List.concat
+        (List.init nargs (fun i ->
+             [ ST (Value.Local (base + nargs - 1 - i)); DROP ]))
+      (* the locals are shared with the other inline sites, so they are
+         initialised here as the prologue of the callee would do *)
+      @ List.concat
+          (List.init nlocals (fun i ->
+               [ CONST 0; ST (Value.Local (base + nargs + i)); DROP ]))
+      @ List.filter_map
+          (function
+            | LINE _ | SLABEL _ -> None
+            | LABEL l -> Some (LABEL (lab l))
+            | FLABEL l -> Some (FLABEL (lab l))
+            | JMP l -> Some (JMP (lab l))
+            | CJMP (c, l) -> Some (CJMP (c, lab l))
+            | CALL (f, n, _) -> Some (CALL (f, n, false))
+            | CALLC (n, _) -> Some (CALLC (n, false))
+            | LD d -> Some (LD (des d))
+            | LDA d -> Some (LDA (des d))
+            | ST d -> Some (ST (des d))
+            | CLOSURE (f, ds) -> Some (CLOSURE (f, List.map des ds))
+            | insn -> Some insn)
+          b
+    in
+    let rec rewrite = function
+      | [] -> []
+      | BEGIN (f, nargs, nlocals, closure, args, scopes) :: code ->
+          let b, code = body code in
+          let extra = Stdlib.ref 0 in
+          let b =
+            List.concat_map
+              (function
+                | CALL (g, n, _) as insn -> (
+                    match Hashtbl.find_opt inlinable g with
+                    | Some ((gargs, glocals, _) as callee) when gargs = n ->
+                        extra := max !extra (gargs + glocals);
+                        expand nlocals callee
+                    | _ -> [ insn ])
+                | insn -> [ insn ])
+              b
+          in
+          (BEGIN (f, nargs, nlocals + !extra, closure, args, scopes) :: b)
+          @ (END :: rewrite code)
+      | insn :: code -> insn :: rewrite code
+    in
+    if Hashtbl.length inlinable = 0 then code else rewrite code
+
+  (* passes with the minimal level they run at *)
+  let passes =
+    [
+      ("inlining", 2, inlining);
+      ("peephole", 1, peephole);
+      ("scopes", 1, scopes);
+      ("threading", 2, threading);
+      ("reachable", 2, reachable);
+    ]
+
+  let optimize cmd code =
+    let level = cmd#get_opt_level in
+    let passes = List.filter (fun (_, l, _) -> l <= level) passes in
+    let stats = Buffer.create 256 in
+    Buffer.add_string stats
+      (Printf.sprintf "level %d, %d instructions\n" level (List.length code));
+    let rec round i code =
+      let code' =
+        List.fold_left
+          (fun code (name, _, pass) ->
+            let code' = pass code in
+            Buffer.add_string stats
+              (Printf.sprintf "round %d, %-10s %d -> %d\n" i name
+                 (List.length code) (List.length code'));
+            code')
+          code passes
+      in
+      if code' = code || i = 8 then code' else round (i + 1) code'
+    in
+    let code = if passes = [] then code else round 1 code in
+    Buffer.add_string stats
+      (Printf.sprintf "%d instructions\n" (List.length code));
+    cmd#dump_opt (Buffer.contents stats);
+    code
+end
+
 let show_prg p =
   let b = Buffer.create 512 in
   List.iter
@@ -570,7 +1123,7 @@ let[@ocaml.warning "-8-20"] rec eval env
             eval env
               (env#builtin f args ((cstack, stack', glob, loc, i, o) : config))
               prg'
-      | CALLC (n, _) -> (
+      | CALLC (n, _) | KCALLC (_, n, _) -> (
           let vs, stack' = split (n + 1) stack in
           let (f :: args) = List.rev vs in
           match f with
@@ -1266,6 +1819,28 @@ class env cmd imports =
           | _ -> (self, []))
   end [@@ocaml.warning "-15"]
 
+(* matches a pattern against a construction of an array or an S-expression
+   with the given components without building it: returns the patterns the
+   components are to be matched with, `Never if the pattern can not match, and
+   `Escapes if the pattern needs the constructed value itself. This is the only
+   escape analysis there is: an aggregate which is not the scrutinee of a case
+   is always allocated in the heap, since the collector expects every boxed
+   value there *)
+let scalar_match e p =
+  let wildcards es = `Components (List.map (fun _ -> Pattern.Wildcard) es) in
+  match (e, p) with
+  | Expr.Array es, Pattern.Array ps when List.length es = List.length ps ->
+      `Components ps
+  | Expr.Sexp (t, es), Pattern.Sexp (t', ps)
+    when t = t' && List.length es = List.length ps ->
+      `Components ps
+  | (Expr.Array es | Expr.Sexp (_, es)), (Pattern.Wildcard | Pattern.Boxed) ->
+      wildcards es
+  | Expr.Array es, Pattern.ArrayTag | Expr.Sexp (_, es), Pattern.SexpTag ->
+      wildcards es
+  | _, Pattern.Named _ -> `Escapes
+  | _ -> `Never
+
 let compile cmd ((imports, _), p) =
   let rec pattern env lfalse = function
     | Pattern.Wildcard -> (env, false, [ DROP ])
@@ -1535,20 +2110,178 @@ let compile cmd ((imports, _), p) =
           @ (if fe then [ LABEL lexp ] else [])
           @ [ CJMP ("nz", loop) ] )
     | Expr.Leave -> (env, false, [])
+    | Expr.Case (((Expr.Array es | Expr.Sexp (_, es)) as e), brs, loc, atr)
+      when cmd#get_opt_level > 0
+           && List.for_all (fun (p, _) -> scalar_match e p <> `Escapes) brs ->
+        (* the scrutinee is constructed right away and does not escape: its
+           components are kept in fresh locals of the scope of the case and
+           matched one by one, and the value is only built on a failure *)
+        let blab, env = env#get_label in
+        let elab, env = env#get_label in
+        let env = env#push_scope blab elab in
+        let env, temps =
+          List.fold_left
+            (fun (env, temps) _ ->
+              let name = Printf.sprintf "$case%d" (List.length temps) in
+              let env, dsg = (env#add_name name `Local Mut)#lookup name in
+              (env, temps @ [ dsg ]))
+            (env, []) es
+        in
+        let env, scode =
+          List.fold_left2
+            (fun (env, code) e dsg ->
+              let le, env = env#get_label in
+              let env, flag, ecode = compile_expr false le env e in
+              ( env,
+                code @ ecode
+                @ (if flag then [ LABEL le ] else [])
+                @ [ ST dsg; DROP ] ))
+            (env, []) es temps
+        in
+        let brs =
+          List.filter_map
+            (fun (p, s) ->
+              match scalar_match e p with
+              | `Components ps -> Some (ps, s)
+              | _ -> None)
+            brs
+        in
+        let n = List.length brs in
+        let entries, env =
+          List.fold_left
+            (fun (acc, env) _ ->
+              let l, env = env#get_label in
+              (acc @ [ l ], env))
+            ([], env) brs
+        in
+        let lfail, env = env#get_label in
+        let entry i = if i = n then lfail else List.nth entries i in
+        let env, _, code, fail =
+          List.fold_left
+            (fun ((env, i, code, continue) as acc) (ps, s) ->
+              if continue then
+                let env, refutable, pcode =
+                  List.fold_left2
+                    (fun (env, refutable, code) p dsg ->
+                      let env, r, pcode = pattern env (entry (i + 1)) p in
+                      (env, refutable || r, code @ (LD dsg :: pcode)))
+                    (env, false, []) ps temps
+                in
+                let blab, env = env#get_label in
+                let elab, env = env#get_label in
+                let env = env#push_scope blab elab in
+                let env, bindcode =
+                  List.fold_left2
+                    (fun (env, code) p dsg ->
+                      let env, bcode = bindings env p in
+                      (env, code @ (LD dsg :: bcode)))
+                    (env, []) ps temps
+                in
+                let env, _, bcode = compile_expr tail l env s in
+                let env = env#pop_scope in
+                ( env,
+                  i + 1,
+                  code
+                  @ (if i = 0 then [ SLABEL blab ]
+                    else [ SLABEL blab; LABEL (entry i) ])
+                  @ pcode @ bindcode @ bcode
+                  @ [ JMP l; SLABEL elab ],
+                  refutable )
+              else acc)
+            (env, 0, [], true) brs
+        in
+        let build =
+          match e with
+          | Expr.Sexp (t, _) -> SEXP (t, List.length es)
+          | _ -> CALL (".array", List.length es, false)
+        in
+        ( env#pop_scope,
+          true,
+          [ SLABEL blab ] @ scode @ code
+          @ (if fail then
+               LABEL lfail
+               :: List.map (fun dsg -> LD dsg) temps
+               @ [ build; FAIL (loc, atr != Expr.Void); JMP l ]
+             else [])
+          @ [ SLABEL elab ] )
     | Expr.Case (e, brs, loc, atr) ->
         let n = List.length brs - 1 in
-        let lfail, env = env#get_label in
         let lexp, env = env#get_label in
+        (* entries of the branches but the first one, then the failure label *)
+        let entries, env =
+          List.fold_left
+            (fun (acc, env) _ ->
+              let l, env = env#get_label in
+              (l :: acc, env))
+            ([], env) brs
+        in
+        let entry j = List.nth entries (n + 1 - j) in
+        let lfail = entry (n + 1) in
+        let rec top = function Pattern.Named (_, p) -> top p | p -> p in
+        let tops = List.map (fun (p, _) -> top p) brs in
+        (* the entry of the first branch after the i-th one which is not
+           skipped: when the top-level S-expression pattern of a branch fails,
+           the branches which fail for the same reason are not tried *)
+        let next i skip =
+          let rec inner j = function
+            | p :: ps when skip p -> inner (j + 1) ps
+            | _ -> entry j
+          in
+          inner (i + 1) (List.filteri (fun j _ -> j > i) tops)
+        in
+        (* a top-level S-expression pattern: a failed tag test skips the
+           branches with the same tag and arity, a failed subpattern skips the
+           ones which can not match an S-expression of this tag and arity; the
+           latter failure is handled out of line. This is not a decision tree:
+           the branches are still tried in order and a tag which failed may be
+           tested again after a branch with another tag; switching on the tag
+           hash and arity once would need a new SM instruction *)
+        let sexp env i t ps =
+          let arity = List.length ps in
+          let same = function
+            | Pattern.Sexp (t', ps') -> t = t' && arity = List.length ps'
+            | _ -> false
+          in
+          let other = function
+            | Pattern.Sexp _ as p -> not (same p)
+            | Pattern.Const _ | Pattern.String _ | Pattern.Array _
+            | Pattern.ArrayTag | Pattern.StringTag | Pattern.ClosureTag
+            | Pattern.UnBoxed ->
+                true
+            | _ -> false
+          in
+          let lhead, env = env#get_label in
+          let ldrop, env = env#get_label in
+          let code, env = pattern_list lhead ldrop env ps in
+          ( env,
+            [
+              DUP;
+              TAG (t, arity);
+              CJMP ("nz", lhead);
+              DROP;
+              JMP (next i same);
+              LABEL lhead;
+            ]
+            @ code @ [ DROP ],
+            [ LABEL ldrop; DROP; JMP (next i other) ] )
+        in
         let env, fe, se = compile_expr false lexp env e in
-        let env, _, _, code, fail =
+        let env, _, code, outs, fail =
           List.fold_left
-            (fun ((env, lab, i, code, continue) as acc) (p, s) ->
+            (fun ((env, i, code, outs, continue) as acc) (p, s) ->
               if continue then
-                let (lfalse, env), jmp =
-                  if i = n then ((lfail, env), [])
-                  else (env#get_label, [ JMP l ])
+                let lfalse, jmp =
+                  if i = n then (lfail, []) else (entry (i + 1), [ JMP l ])
+                in
+                let env, lfalse', pcode, out =
+                  match top p with
+                  | Pattern.Sexp (t, ps) ->
+                      let env, pcode, out = sexp env i t ps in
+                      (env, true, pcode, out)
+                  | _ ->
+                      let env, lfalse', pcode = pattern env lfalse p in
+                      (env, lfalse', pcode, [])
                 in
-                let env, lfalse', pcode = pattern env lfalse p in
                 let blab, env = env#get_label in
                 let elab, env = env#get_label in
                 let env = env#push_scope blab elab in
@@ -1556,16 +2289,15 @@ let compile cmd ((imports, _), p) =
                 let env, _, scode = compile_expr tail l env s in
                 let env = env#pop_scope in
                 ( env,
-                  Some lfalse,
                   i + 1,
-                  ((match lab with
-                   | None -> [ SLABEL blab ]
-                   | Some l -> [ SLABEL blab; LABEL l; DUP ])
+                  ((if i = 0 then [ SLABEL blab ]
+                   else [ SLABEL blab; LABEL (entry i); DUP ])
                   @ pcode @ bindcode @ scode @ jmp @ [ SLABEL elab ])
                   :: code,
+                  outs @ out,
                   lfalse' )
               else acc)
-            (env, None, 0, [], true) brs
+            (env, 0, [], [], true) brs
         in
         ( env,
           true,
@@ -1573,7 +2305,7 @@ let compile cmd ((imports, _), p) =
           @ (if fe then [ LABEL lexp ] else [])
           @ [ DUP ]
           @ (List.flatten @@ List.rev code)
-          @ [ JMP l ]
+          @ [ JMP l ] @ outs
           @
           if fail then [ LABEL lfail; FAIL (loc, atr != Expr.Void); JMP l ]
           else [] )
@@ -1622,12 +2354,12 @@ let compile cmd ((imports, _), p) =
           CLOSURE (f, env#get_closure (f, c)) :: inner state tl
       | PPROTO (f, c) :: tl -> (
           match env#get_closure (f, c) with
-          | [] -> inner (Some f :: state) tl
-          | closure -> CLOSURE (f, closure) :: inner (None :: state) tl)
+          | [] -> inner (`Direct f :: state) tl
+          | closure -> CLOSURE (f, closure) :: inner (`Known f :: state) tl)
       | PCALLC (n, tail) :: tl -> (
           match state with
-          | None :: state' -> CALLC (n, tail) :: inner state' tl
-          | Some f :: state' -> CALL (f, n, tail) :: inner state' tl
+          | `Known f :: state' -> KCALLC (f, n, tail) :: inner state' tl
+          | `Direct f :: state' -> CALL (f, n, tail) :: inner state' tl
           | _ ->
               failwith
                 (Printf.sprintf "Unexpected pattern: %s: %d" __FILE__ __LINE__))
@@ -1670,6 +2402,6 @@ let compile cmd ((imports, _), p) =
   Printf.eprintf "%s\n%!" env#show_funinfo;
    *)
   (*Printf.eprintf "Before fix:\n%s\n" (show_prg prg);  *)
-  let prg = fix_closures env prg in
+  let prg = Optimizer.optimize cmd (fix_closures env prg) in
   cmd#dump_SM prg;
   prg
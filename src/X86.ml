@@ -132,6 +132,345 @@ let show instr =
 (* Opening stack machine to use instructions without fully qualified names *)
 open SM
 
+(* the maximal number of words of an object allocated inline, see
+   `GC inline allocation` in runtime/gc.h *)
+let max_inline_alloc = 16
+
+(* the maximal number of locals initialised by separate stores in a prologue,
+   a larger frame is filled by rep movs *)
+let max_inline_init = 8
+
+(* Register allocation
+
+     allocate_registers :
+       prg -> (int * int, opnd * int) Hashtbl.t * (int, int) Hashtbl.t
+
+   The symbolic stack discipline of the code generator is replayed over the
+   stack code in advance: each position allocated on the symbolic stack (a slot)
+   lives from its allocation to its pop, and the slots which meet at a label are
+   merged. The merged live intervals of a function are then given locations by
+   linear scan: an interval which is live across a call is put into the frame
+   (where the GC stack maps see it) instead of being saved and restored around
+   the call, the others get registers while there are free ones, and when there
+   are none the interval ending last is spilled into the frame.
+
+   The result maps the number of an instruction and the number of an allocation
+   within it to a location and the depth of the symbolic stack the replay had
+   there, and the number of a BEGIN to the number of frame slots used for
+   spills in its function (they follow the locals). The code generator checks
+   the depth: a replay which drifted from it would give out locations of live
+   slots
+*)
+let allocate_registers prg =
+  (* the slot events of an instruction, in the order the code generator
+     allocates, pops and calls *)
+  let events insn scode =
+    let pops n = List.init n (fun _ -> `Pop) in
+    let call n = pops n @ [ `Call; `Alloc ] in
+    match insn with
+    | CLOSURE (_, closure) when List.length closure < max_inline_alloc ->
+        [ `Alloc ]
+    | CLOSURE _ -> [ `Call; `Alloc ]
+    | CONST _ | LD _ | DUP -> [ `Alloc ]
+    | STRING _ when read_only_value scode -> [ `Alloc ]
+    | STRING _ -> `Alloc :: call 1
+    | LDA _ -> [ `Alloc; `Alloc ]
+    | STA -> call 3
+    | STI | ELEM | PATT StrCmp -> call 2
+    | PATT _ | TAG _ | ARRAY _ -> [ `Pop; `Alloc ]
+    | BINOP _ | CJMP _ | DROP | END | FAIL (_, false) -> [ `Pop ]
+    | CALL (".array", 0, _) | SEXP (_, 0) -> [ `Alloc ]
+    | CALL (".array", n, _) when n <= max_inline_alloc -> pops n @ [ `Alloc ]
+    | CALL (_, n, _) -> call n
+    | CALLC (n, _) | KCALLC (_, n, _) -> call (n + 1)
+    | SEXP (_, n) when n < max_inline_alloc -> pops n @ [ `Alloc ]
+    | SEXP (_, n) -> `Alloc :: call (n + 1)
+    | _ -> []
+  in
+  let table = Hashtbl.create 1024 in
+  let spills = Hashtbl.create 64 in
+  (* slots: allocation keys, stack depths, start and end times, and a
+     union-find forest *)
+  let keys = Hashtbl.create 1024 in
+  let depths = Hashtbl.create 1024 in
+  let starts = Hashtbl.create 1024 in
+  let ends = Hashtbl.create 1024 in
+  let parent = Hashtbl.create 1024 in
+  let rec find s =
+    match Hashtbl.find_opt parent s with
+    | Some p ->
+        let r = find p in
+        Hashtbl.replace parent s r;
+        r
+    | None -> s
+  in
+  let merge st st' =
+    if List.length st = List.length st' then
+      List.iter2
+        (fun s s' ->
+          let r = find s and r' = find s' in
+          if r <> r' then Hashtbl.replace parent r r')
+        st st'
+  in
+  (* stacks at jumps to labels and at the labels themselves *)
+  let saved = Hashtbl.create 256 in
+  let passed = Hashtbl.create 256 in
+  let nslots = ref 0 in
+  let func = ref None in
+  let stack = ref [] in
+  let barrier = ref false in
+  let time = ref 0 in
+  let calls = ref [] in
+  let slots = ref [] in
+  let set_stack l =
+    Option.iter (merge !stack) (Hashtbl.find_opt saved l);
+    Option.iter (merge !stack) (Hashtbl.find_opt passed l);
+    Hashtbl.replace saved l !stack
+  in
+  let finish () =
+    match !func with
+    | None -> ()
+    | Some (b, nlocals) ->
+        let intervals = Hashtbl.create 64 in
+        List.iter
+          (fun s ->
+            let c = find s in
+            let i = Hashtbl.find starts s in
+            let j = Option.value (Hashtbl.find_opt ends s) ~default:!time in
+            match Hashtbl.find_opt intervals c with
+            | None -> Hashtbl.replace intervals c (i, j)
+            | Some (i', j') -> Hashtbl.replace intervals c (min i i', max j j'))
+          !slots;
+        let intervals =
+          List.sort compare
+            (Hashtbl.fold (fun c (i, j) acc -> (i, j, c) :: acc) intervals [])
+        in
+        let location = Hashtbl.create 64 in
+        let free = ref (List.init (num_of_regs + 1) (fun i -> R i)) in
+        let active = ref [] in
+        let frame = ref [] in
+        let free_frame = ref [] in
+        let nframe = ref 0 in
+        let spill j c =
+          let n =
+            match !free_frame with
+            | n :: tl ->
+                free_frame := tl;
+                n
+            | [] ->
+                incr nframe;
+                !nframe - 1
+          in
+          frame := (j, n) :: !frame;
+          Hashtbl.replace location c (S (nlocals + n))
+        in
+        List.iter
+          (fun (i, j, c) ->
+            let expired, live = List.partition (fun (j', _) -> j' < i) !active in
+            active := live;
+            List.iter
+              (fun (_, c') -> free := Hashtbl.find location c' :: !free)
+              expired;
+            let expired, live = List.partition (fun (j', _) -> j' < i) !frame in
+            frame := live;
+            free_frame := List.map snd expired @ !free_frame;
+            if List.exists (fun t -> i < t && t < j) !calls then spill j c
+            else
+              match !free with
+              | r :: tl ->
+                  free := tl;
+                  active := (j, c) :: !active;
+                  Hashtbl.replace location c r
+              | [] ->
+                  let j', c' = List.fold_left max (List.hd !active) !active in
+                  if j' > j then (
+                    Hashtbl.replace location c (Hashtbl.find location c');
+                    active :=
+                      (j, c) :: List.filter (fun (_, c'') -> c'' <> c') !active;
+                    spill j' c')
+                  else spill j c)
+          intervals;
+        List.iter
+          (fun s ->
+            Hashtbl.replace table (Hashtbl.find keys s)
+              (Hashtbl.find location (find s), Hashtbl.find depths s))
+          !slots;
+        Hashtbl.replace spills b !nframe
+  in
+  let rec replay i = function
+    | [] -> finish ()
+    | insn :: scode ->
+        (if !barrier then (
+           match insn with
+           | LABEL s -> (
+               match Hashtbl.find_opt saved s with
+               | Some st ->
+                   barrier := false;
+                   stack := st
+               | None -> stack := [])
+           | FLABEL _ -> barrier := false
+           | END ->
+               barrier := false;
+               stack := []
+           | _ -> ())
+         else
+           match insn with
+           | BEGIN (_, _, nlocals, _, _, _) ->
+               finish ();
+               func := Some (i, nlocals);
+               stack := [];
+               time := 0;
+               calls := [];
+               slots := []
+           | LABEL s | FLABEL s | SLABEL s ->
+               Option.iter (merge !stack) (Hashtbl.find_opt saved s);
+               Hashtbl.replace passed s !stack
+           | JMP l ->
+               set_stack l;
+               barrier := true
+           | _ ->
+               ignore
+                 (List.fold_left
+                    (fun k event ->
+                      incr time;
+                      match event with
+                      | `Alloc ->
+                          let s = !nslots in
+                          incr nslots;
+                          Hashtbl.replace keys s (i, k);
+                          Hashtbl.replace depths s (List.length !stack);
+                          Hashtbl.replace starts s !time;
+                          slots := s :: !slots;
+                          stack := s :: !stack;
+                          k + 1
+                      | `Pop ->
+                          (match !stack with
+                          | s :: st ->
+                              Hashtbl.replace ends s !time;
+                              stack := st
+                          | [] -> ());
+                          k
+                      | `Call ->
+                          calls := !time :: !calls;
+                          k)
+                    0 (events insn scode));
+               match insn with CJMP (_, l) -> set_stack l | _ -> ());
+        replay (i + 1) scode
+  in
+  replay 0 prg;
+  (table, spills)
+
+(* Frame initialisation
+
+     observed_locals : prg -> (int, int list) Hashtbl.t
+
+   Every local of a function is in the GC stack maps of its call sites, and a
+   local read before it is stored to reads as zero. A forward analysis finds the locals
+   which are stored to on every path from the entry; the other ones may be
+   read or reach a stack map first. Only they are initialised by the prologue
+   (temporaries are always written before a call). A local whose address is
+   taken is always initialised.
+
+   The result maps the number of a BEGIN to the locals to initialise
+*)
+let observed_locals prg =
+  let module IS = Set.Make (Int) in
+  let observed = Hashtbl.create 64 in
+  let gc_free = function
+    | LD _ | LDA _ | ST _ | CONST _ | DUP | DROP | SWAP | BINOP _ | TAG _
+    | ARRAY _ | LABEL _ | FLABEL _ | SLABEL _ | JMP _ | CJMP _ | LINE _ | END
+    | RET | CLOSURE (_, []) | SEXP (_, 0) | CALL (".array", 0, _) ->
+        true
+    | PATT p -> p <> StrCmp
+    | _ -> false
+  in
+  let reads = function
+    | LD (Value.Local i) | LDA (Value.Local i) -> [ i ]
+    | CLOSURE (_, ds) ->
+        List.filter_map (function Value.Local i -> Some i | _ -> None) ds
+    | _ -> []
+  in
+  let analyse b nlocals body =
+    let body = Array.of_list body in
+    let n = Array.length body in
+    let labels = Hashtbl.create 16 in
+    Array.iteri
+      (fun i -> function
+        | LABEL l | FLABEL l -> Hashtbl.replace labels l i | _ -> ())
+      body;
+    let succs i =
+      match body.(i) with
+      | JMP l -> [ Hashtbl.find labels l ]
+      | CJMP (_, l) -> [ Hashtbl.find labels l; i + 1 ]
+      | END | RET -> []
+      | _ -> [ i + 1 ]
+    in
+    (* the locals stored to on every path to an instruction; None if it is
+       unreachable *)
+    let stored = Array.make (n + 1) None in
+    stored.(0) <- Some IS.empty;
+    let work = Stack.create () in
+    Stack.push 0 work;
+    while not (Stack.is_empty work) do
+      let i = Stack.pop work in
+      match stored.(i) with
+      | Some s when i < n ->
+          let s =
+            match body.(i) with ST (Value.Local j) -> IS.add j s | _ -> s
+          in
+          List.iter
+            (fun j ->
+              match stored.(j) with
+              | None ->
+                  stored.(j) <- Some s;
+                  Stack.push j work
+              | Some s' when not (IS.subset s' s) ->
+                  stored.(j) <- Some (IS.inter s s');
+                  Stack.push j work
+              | _ -> ())
+            (succs i)
+      | _ -> ()
+    done;
+    let all = IS.of_list (List.init nlocals Fun.id) in
+    let init =
+      Array.to_list body
+      |> List.mapi (fun i insn -> (i, insn))
+      |> List.fold_left
+           (fun acc (i, insn) ->
+             match stored.(i) with
+             | None -> acc
+             | Some s ->
+                 let acc =
+                   match insn with
+                   | LDA (Value.Local j) -> IS.add j acc
+                   | _ -> acc
+                 in
+                 let acc =
+                   List.fold_left
+                     (fun acc j -> if IS.mem j s then acc else IS.add j acc)
+                     acc (reads insn)
+                 in
+                 if gc_free insn then acc else IS.union acc (IS.diff all s))
+           IS.empty
+    in
+    Hashtbl.replace observed b (IS.elements init)
+  in
+  let rec functions i = function
+    | [] -> ()
+    | BEGIN (_, _, nlocals, _, _, _) :: code ->
+        let rec body acc = function
+          | (END as insn) :: code -> (List.rev (insn :: acc), code)
+          | insn :: code -> body (insn :: acc) code
+          | [] -> (List.rev acc, [])
+        in
+        let b, code = body [] code in
+        analyse i nlocals b;
+        functions (i + 1 + List.length b) code
+    | _ :: code -> functions (i + 1) code
+  in
+  functions 0 prg;
+  observed
+
 (* Symbolic stack machine evaluator
 
      compile : env -> prg -> env * instr list
@@ -152,14 +491,25 @@ let compile cmd env imports code =
     | _ -> failwith "unknown operator"
   in
   let box n = (n lsl 1) lor 1 in
+  (* object tags, see runtime/runtime_common.h *)
+  let string_tag, array_tag, sexp_tag, closure_tag = (1, 3, 5, 7) in
   let rec compile' env scode =
     let on_stack = function S _ -> true | _ -> false in
     let mov x s =
       if on_stack x && on_stack s then [ Mov (x, eax); Mov (eax, s) ]
       else [ Mov (x, s) ]
     in
-    let callc env n tail =
-      let tail = tail && env#nargs = n in
+    (* a call in a tail position jumps to the callee with the arguments moved
+       into the slots of the current ones; since the caller pops the arguments
+       it has pushed, the callee may take fewer of them (the rest are still
+       valid values, visited by the caller's stack map), but not more: a call
+       with more arguments is an ordinary call and grows the stack, which only
+       a callee-pops convention would avoid *)
+    let tail_call env n tail = tail && n <= env#nargs in
+    (* calls a closure; the function is given if it is known statically, then
+       it is called directly *)
+    let callc ?f env n tail =
+      let tail = tail_call env n tail in
       if tail then
         let rec push_args env acc = function
           | 0 -> (env, acc)
@@ -174,11 +524,18 @@ let compile cmd env imports code =
         let _, env = env#allocate in
         ( env,
           pushs
-          @ [
-              Mov (closure, edx); Mov (I (0, edx), eax); Mov (ebp, esp); Pop ebp;
-            ]
+          @ (match f with
+            | Some _ -> [ Mov (closure, edx); Mov (ebp, esp); Pop ebp ]
+            | None ->
+                [
+                  Mov (closure, edx);
+                  Mov (I (0, edx), eax);
+                  Mov (ebp, esp);
+                  Pop ebp;
+                ])
           @ (if env#has_closure then [ Pop ebx ] else [])
-          @ [ Jmp "*%eax" ] ) (* UGLY!!! *)
+          @ [ Jmp (match f with Some f -> f | None -> "*%eax") ] )
+        (* UGLY!!! *)
       else
         let pushr, popr =
           List.split
@@ -195,21 +552,24 @@ let compile cmd env imports code =
           let env, pushs = push_args env [] n in
           let pushs = List.rev pushs in
           let closure, env = env#pop in
+          let sm, env = env#stack_map (List.length pushr + List.length pushs) in
           let call_closure =
-            if on_stack closure then
-              [ Mov (closure, edx); Mov (edx, eax); CallI eax ]
-            else [ Mov (closure, edx); CallI closure ]
+            match f with
+            | Some f -> [ Mov (closure, edx); Call f ]
+            | None when on_stack closure ->
+                [ Mov (closure, edx); Mov (edx, eax); CallI eax ]
+            | None -> [ Mov (closure, edx); CallI closure ]
           in
           ( env,
             pushr @ pushs @ call_closure
-            @ [ Binop ("+", L (word_size * List.length pushs), esp) ]
+            @ [ Label sm; Binop ("+", L (word_size * List.length pushs), esp) ]
             @ List.rev popr )
         in
         let y, env = env#allocate in
         (env, code @ [ Mov (eax, y) ])
     in
     let call env f n tail =
-      let tail = tail && env#nargs = n && f.[0] <> '.' in
+      let tail = tail_call env n tail && f.[0] <> '.' in
       let f =
         match f.[0] with
         | '.' -> "B" ^ String.sub f 1 (String.length f - 1)
@@ -250,19 +610,160 @@ let compile cmd env imports code =
             | "Barray" -> List.rev @@ (Push (L (box n)) :: pushs)
             | "Bsexp" -> List.rev @@ (Push (L (box n)) :: pushs)
             | "Bsta" -> pushs
+            | "Bsti" -> pushs
             | _ -> List.rev pushs
           in
+          let sm, env = env#stack_map (List.length pushr + List.length pushs) in
           ( env,
             pushr @ pushs
-            @ [ Call f; Binop ("+", L (word_size * List.length pushs), esp) ]
+            @ [
+                Call f;
+                Label sm;
+                Binop ("+", L (word_size * List.length pushs), esp);
+              ]
             @ List.rev popr )
         in
         let y, env = env#allocate in
         (env, code @ [ Mov (eax, y) ])
     in
+    (* allocates an object with the given header and contents; the last n
+       contents words are popped from the symbolic stack after the allocation,
+       so they are kept alive (and updated) by the GC if Balloc is called *)
+    let alloc env header contents n =
+      let bytes = word_size * (List.length contents + 2) in
+      let pushr, popr =
+        List.split
+        @@ List.map (fun r -> (Push r, Pop r)) (env#live_registers 0)
+      in
+      let pushr, popr = (env#save_closure @ pushr, env#rest_closure @ popr) in
+      let sm, env = env#stack_map (List.length pushr + 1) in
+      let fast, env = env#fresh_label in
+      let fill, env = env#fresh_label in
+      let store i x =
+        let y = I (word_size * (i + 2), eax) in
+        match x with
+        | R _ | L _ -> [ Mov (x, y) ]
+        | M s when s.[0] = '$' -> [ Mov (x, y) ]
+        | _ -> [ Push x; Pop y ]
+      in
+      let rec popn env = function 0 -> env | n -> popn (snd env#pop) (n - 1) in
+      let s, env = (popn env n)#allocate in
+      ( env,
+        [
+          Mov (M "__gc_alloc_ptr", eax);
+          Binop ("+", L bytes, eax);
+          Binop ("cmp", M "__gc_alloc_limit", eax);
+          CJmp ("be", fast);
+        ]
+        @ pushr
+        @ [
+            Push (L (box bytes));
+            Call "Balloc";
+            Label sm;
+            Binop ("+", L word_size, esp);
+          ]
+        @ List.rev popr
+        @ [
+            Jmp fill;
+            Label fast;
+            Mov (eax, M "__gc_alloc_ptr");
+            Binop ("-", L bytes, eax);
+            Label fill;
+            Mov (L header, I (0, eax));
+            Mov (L 0, I (word_size, eax));
+          ]
+        @ List.concat (List.mapi store contents)
+        @ [ Lea (I (2 * word_size, eax), eax); Mov (eax, s) ] )
+    in
+    (* a runtime primitive with an inline fast path: the fast path gets the
+       operands (the topmost one is the last) and the label of the slow path,
+       which calls the runtime function, and leaves the result in %eax *)
+    let fast_call env f n fast =
+      let lslow, env = env#fresh_label in
+      let ldone, env = env#fresh_label in
+      let code, env = fast env (env#peekn n) lslow in
+      let env, slow = call env f n false in
+      ( env,
+        code @ env#reload_closure
+        @ [ Mov (eax, env#peek); Jmp ldone; Label lslow ]
+        @ slow @ [ Label ldone ] )
+    in
+    (* the address of an element of an array or an S-expression (its fields
+       follow the tag) into %eax, with the object in %edx; strings, unboxed
+       objects and indices go to the slow path *)
+    let element env x i lslow =
+      let lindex, env = env#fresh_label in
+      ( [
+          Mov (x, edx);
+          Binop ("test", L 1, edx);
+          CJmp ("nz", lslow);
+          Mov (I (-2 * word_size, edx), eax);
+          Binop ("&&", L 7, eax);
+          Binop ("cmp", L array_tag, eax);
+          CJmp ("e", lindex);
+          Binop ("cmp", L sexp_tag, eax);
+          CJmp ("ne", lslow);
+          Binop ("+", L word_size, edx);
+          Label lindex;
+          Mov (i, eax);
+          Binop ("test", L 1, eax);
+          CJmp ("z", lslow);
+          Binop ("&&", L (-2), eax);
+          Sal1 eax;
+          Binop ("+", edx, eax);
+        ],
+        env )
+    in
+    (* matches the value on the top of the stack inline: the checks are given
+       a label to jump to on failure and test the value in %eax; the object
+       header precedes the contents by two words, see runtime/runtime_common.h *)
+    let patt env checks =
+      let x, env = env#pop in
+      let lfalse, env = env#fresh_label in
+      let ldone, env = env#fresh_label in
+      let s, env = env#allocate in
+      ( env,
+        [ Mov (x, eax) ]
+        @ checks lfalse
+        @ [
+            Mov (L (box 1), s);
+            Jmp ldone;
+            Label lfalse;
+            Mov (L (box 0), s);
+            Label ldone;
+          ] )
+    in
+    let boxed lfalse = [ Binop ("test", L 1, eax); CJmp ("nz", lfalse) ] in
+    let header h lfalse =
+      [ Binop ("cmp", L h, I (-2 * word_size, eax)); CJmp ("ne", lfalse) ]
+    in
+    (* the epilogue of a function; an END after a barrier is unreachable, but
+       the function still needs its epilogue and frame size symbols *)
+    let leave env result =
+      let name = env#fname in
+      ( env#leave,
+        result
+        @ [ Label env#epilogue; Mov (ebp, esp); Pop ebp ]
+        @ env#rest_closure
+        @ (if name = "main" then [ Binop ("^", eax, eax) ] else [])
+        @ [
+            Meta "\t.cfi_restore\t5";
+            Meta "\t.cfi_def_cfa\t4, 4";
+            Ret;
+            Meta "\t.cfi_endproc";
+            Meta
+              (Printf.sprintf "\t.set\t%s,\t%d" env#lsize
+                 (env#allocated * word_size));
+            Meta
+              (Printf.sprintf "\t.set\t%s,\t%d" env#allocated_size
+                 env#allocated);
+            Meta (Printf.sprintf "\t.size %s, .-%s" name name);
+          ] )
+    in
     match scode with
     | [] -> (env, [])
     | instr :: scode' ->
+        let env = env#next_insn in
         let stack = "" (* env#show_stack*) in
         (* Printf.printf "insn=%s, stack=%s\n%!" (GT.show(insn) instr) (env#show_stack);   *)
         let env', code' =
@@ -274,12 +775,27 @@ let compile cmd env imports code =
                 else (env#drop_stack, [])
             | FLABEL s -> (env#drop_barrier, [ Label s ])
             | SLABEL s -> (env, [ Label s ])
+            | END -> leave env#drop_barrier#drop_stack []
             | _ -> (env, [])
           else
             match instr with
             | PUBLIC name -> (env#register_public name, [])
             | EXTERN name -> (env#register_extern name, [])
             | IMPORT _ -> (env, [])
+            | CLOSURE (name, []) ->
+                let s, env =
+                  env#static_object ("closure " ^ name)
+                    (string_of_int (closure_tag lor (1 lsl 3)))
+                    [ Printf.sprintf ".int\t%s" name ]
+                in
+                let l, env = env#allocate in
+                (env, [ Mov (M ("$" ^ s), l) ])
+            | CLOSURE (name, closure)
+              when List.length closure < max_inline_alloc ->
+                alloc env
+                  (closure_tag lor ((List.length closure + 1) lsl 3))
+                  (M ("$" ^ name) :: List.map env#loc closure)
+                  0
             | CLOSURE (name, closure) ->
                 let pushr, popr =
                   List.split
@@ -289,6 +805,9 @@ let compile cmd env imports code =
                 let push_closure =
                   List.map (fun d -> Push (env#loc d)) @@ List.rev closure
                 in
+                let sm, env =
+                  env#stack_map (List.length pushr + closure_len + 2)
+                in
                 let s, env = env#allocate in
                 ( env,
                   pushr @ push_closure
@@ -296,6 +815,7 @@ let compile cmd env imports code =
                       Push (M ("$" ^ name));
                       Push (L (box closure_len));
                       Call "Bclosure";
+                      Label sm;
                       Binop ("+", L (word_size * (closure_len + 2)), esp);
                       Mov (eax, s);
                     ]
@@ -303,6 +823,10 @@ let compile cmd env imports code =
             | CONST n ->
                 let s, env' = env#allocate in
                 (env', [ Mov (L (box n), s) ])
+            | STRING s when read_only_value scode' ->
+                let s, env = env#static_string s in
+                let l, env = env#allocate in
+                (env, [ Mov (M ("$" ^ s), l) ])
             | STRING s ->
                 let s, env = env#string s in
                 let l, env = env#allocate in
@@ -321,24 +845,56 @@ let compile cmd env imports code =
             | ST x -> (
                 let env' = env#variable x in
                 let s = env'#peek in
-                ( env',
+                let store =
                   match s with
                   | S _ | M _ -> [ Mov (s, eax); Mov (eax, env'#loc x) ]
-                  | _ -> [ Mov (s, env'#loc x) ] ))
-            | STA -> call env ".sta" 3 false
-            | STI -> (
-                let v, x, env' = env#pop2 in
-                ( env'#push x,
-                  match x with
-                  | S _ | M _ ->
-                      [
-                        Mov (v, edx);
-                        Mov (x, eax);
-                        Mov (edx, I (0, eax));
-                        Mov (edx, x);
-                      ]
-                      @ env#reload_closure
-                  | _ -> [ Mov (v, eax); Mov (eax, I (0, x)); Mov (eax, x) ] ))
+                  | _ -> [ Mov (s, env'#loc x) ]
+                in
+                match x with
+                | Value.Access _ ->
+                    (* a captured variable lives in the closure, which may be
+                       old: the store goes through the write barrier as in STA *)
+                    let lstored, env' = env'#fresh_label in
+                    ( env',
+                      store
+                      @ [
+                          Mov (s, eax);
+                          Binop ("test", L 1, eax);
+                          CJmp ("nz", lstored);
+                          Push ecx;
+                          Push eax;
+                          Lea (env'#loc x, eax);
+                          Push eax;
+                          Call "gc_write_barrier";
+                          Binop ("+", L (2 * word_size), esp);
+                          Pop ecx;
+                        ]
+                      @ env'#reload_closure @ [ Label lstored ] )
+                | _ -> (env', store))
+            | STA ->
+                fast_call env ".sta" 3 (fun env args lslow ->
+                    let[@ocaml.warning "-8"] [ x; i; v ] = args in
+                    let lstored, env = env#fresh_label in
+                    let addr, env = element env x i lslow in
+                    ( addr
+                      @ [
+                          Mov (v, edx);
+                          Mov (edx, I (0, eax));
+                          (* the write barrier, see runtime/gc.h *)
+                          Binop ("test", L 1, edx);
+                          CJmp ("nz", lstored);
+                          Push ecx;
+                          Push edx;
+                          Push eax;
+                          Call "gc_write_barrier";
+                          Binop ("+", L (2 * word_size), esp);
+                          Pop ecx;
+                          Label lstored;
+                          Mov (v, eax);
+                        ],
+                      env ))
+            (* the store may create an old-to-young reference, so it goes through the write barrier *)
+            | STI -> call env ".sti" 2 false
             | BINOP op -> (
                 let x, y, env' = env#pop2 in
                 ( env'#push y,
@@ -518,6 +1074,21 @@ let compile cmd env imports code =
                 env#assert_empty_stack;
                 let has_closure = closure <> [] in
                 let env = env#enter f nargs nlocals has_closure in
+                let set_args_sm, env =
+                  if f = "main" then env#stack_map 2 else ("", env)
+                in
+                let inits =
+                  if f = cmd#topname then
+                    List.filter (fun i -> i <> "Std") imports
+                  else []
+                in
+                let env, init_sms =
+                  List.fold_left
+                    (fun (env, sms) _ ->
+                      let sm, env = env#stack_map 0 in
+                      (env, sm :: sms))
+                    (env, []) inits
+                in
                 ( env,
                   [ Meta (Printf.sprintf "\t.type %s, @function" name) ]
                   @ (if f = "main" then []
@@ -563,59 +1134,86 @@ let compile cmd env imports code =
                       Mov (esp, ebp);
                       Meta "\t.cfi_def_cfa_register\t5";
                       Binop ("-", M ("$" ^ env#lsize), esp);
-                      Mov (esp, edi);
-                      Mov (M "$filler", esi);
-                      Mov (M ("$" ^ env#allocated_size), ecx);
-                      Repmovsl;
                     ]
+                  @ (match
+                       if f = "main" || inits <> [] then
+                         List.init nlocals Fun.id
+                       else env#observed_locals
+                     with
+                    | [] -> []
+                    | locals when List.length locals <= max_inline_init ->
+                        List.map
+                          (fun i -> Mov (L (box 0), env#loc (Value.Local i)))
+                          locals
+                    | _ ->
+                        [
+                          Mov (esp, edi);
+                          Mov (M "$filler", esi);
+                          Mov (M ("$" ^ env#allocated_size), ecx);
+                          Repmovsl;
+                        ])
                   @ (if f = "main" then
                      [
                        Call "__gc_init";
                        Push (I (12, ebp));
                        Push (I (8, ebp));
                        Call "set_args";
+                       Label set_args_sm;
                        Binop ("+", L 8, esp);
                      ]
                     else [])
-                  @
-                  if f = cmd#topname then
-                    List.map
-                      (fun i -> Call ("init" ^ i))
-                      (List.filter (fun i -> i <> "Std") imports)
-                  else [] )
+                  @ List.concat
+                  @@ List.map2
+                       (fun i sm -> [ Call ("init" ^ i); Label sm ])
+                       inits (List.rev init_sms) )
             | END ->
                 let x, env = env#pop in
                 env#assert_empty_stack;
-                let name = env#fname in
-                ( env#leave,
-                  [
-                    Mov (x, eax);
-                    (*!!*)
-                    Label env#epilogue;
-                    Mov (ebp, esp);
-                    Pop ebp;
-                  ]
-                  @ env#rest_closure
-                  @ (if name = "main" then [ Binop ("^", eax, eax) ] else [])
-                  @ [
-                      Meta "\t.cfi_restore\t5";
-                      Meta "\t.cfi_def_cfa\t4, 4";
-                      Ret;
-                      Meta "\t.cfi_endproc";
-                      Meta
-                        (Printf.sprintf "\t.set\t%s,\t%d" env#lsize
-                           (env#allocated * word_size));
-                      Meta
-                        (Printf.sprintf "\t.set\t%s,\t%d" env#allocated_size
-                           env#allocated);
-                      Meta (Printf.sprintf "\t.size %s, .-%s" name name);
-                    ] )
+                leave env [ Mov (x, eax) (*!!*) ]
             | RET ->
                 let x = env#peek in
                 (env, [ Mov (x, eax); Jmp env#epilogue ])
-            | ELEM -> call env ".elem" 2 false
+            | ELEM ->
+                fast_call env ".elem" 2 (fun env args lslow ->
+                    let[@ocaml.warning "-8"] [ x; i ] = args in
+                    let addr, env = element env x i lslow in
+                    (addr @ [ Mov (I (0, eax), eax) ], env))
+            | CALL (".array", 0, _) ->
+                let s, env =
+                  env#static_object "array" (string_of_int array_tag) []
+                in
+                let l, env = env#allocate in
+                (env, [ Mov (M ("$" ^ s), l) ])
+            | CALL (".array", n, _) when n <= max_inline_alloc ->
+                alloc env (array_tag lor (n lsl 3)) (env#peekn n) n
+            | CALL ("Llength", 1, _) ->
+                fast_call env "Llength" 1 (fun env args lslow ->
+                    ( [
+                        Mov (List.hd args, eax);
+                        Binop ("test", L 1, eax);
+                        CJmp ("nz", lslow);
+                        Mov (I (-2 * word_size, eax), eax);
+                        Binop ("&&", L (-8), eax);
+                        Sar1 eax;
+                        Sar1 eax;
+                        Or1 eax;
+                      ],
+                      env ))
             | CALL (f, n, tail) -> call env f n tail
             | CALLC (n, tail) -> callc env n tail
+            | KCALLC (f, n, tail) -> callc ~f env n tail
+            | SEXP (t, 0) ->
+                let s, env =
+                  env#static_object ("sexp " ^ t) (string_of_int sexp_tag)
+                    [ Printf.sprintf ".int\t%d" (env#hash t) ]
+                in
+                let l, env = env#allocate in
+                (env, [ Mov (M ("$" ^ s), l) ])
+            | SEXP (t, n) when n < max_inline_alloc ->
+                alloc env
+                  (sexp_tag lor (n lsl 3))
+                  (L (env#hash t) :: env#peekn n)
+                  n
             | SEXP (t, n) ->
                 let s, env = env#allocate in
                 let env, code = call env ".sexp" (n + 1) false in
@@ -629,35 +1227,48 @@ let compile cmd env imports code =
                 let x, y = env#peek2 in
                 (env, [ Push x; Push y; Pop x; Pop y ])
             | TAG (t, n) ->
-                let s1, env = env#allocate in
-                let s2, env = env#allocate in
-                let env, code = call env ".tag" 3 false in
-                ( env,
-                  [ Mov (L (box (env#hash t)), s1); Mov (L (box n), s2) ] @ code
-                )
+                patt env (fun lfalse ->
+                    boxed lfalse
+                    @ header (sexp_tag lor (n lsl 3)) lfalse
+                    @ [
+                        Binop ("cmp", L (env#hash t), I (0, eax));
+                        CJmp ("ne", lfalse);
+                      ])
             | ARRAY n ->
-                let s, env = env#allocate in
-                let env, code = call env ".array_patt" 2 false in
-                (env, [ Mov (L (box n), s) ] @ code)
+                patt env (fun lfalse ->
+                    boxed lfalse @ header (array_tag lor (n lsl 3)) lfalse)
             | PATT StrCmp -> call env ".string_patt" 2 false
-            | PATT patt ->
-                call env
-                  (match patt with
-                  | Boxed -> ".boxed_patt"
-                  | UnBoxed -> ".unboxed_patt"
-                  | Array -> ".array_tag_patt"
-                  | String -> ".string_tag_patt"
-                  | Sexp -> ".sexp_tag_patt"
-                  | Closure -> ".closure_tag_patt"
-                  | StrCmp ->
+            | PATT Boxed ->
+                patt env (fun lfalse ->
+                    [ Binop ("test", L 1, eax); CJmp ("nz", lfalse) ])
+            | PATT UnBoxed ->
+                patt env (fun lfalse ->
+                    [ Binop ("test", L 1, eax); CJmp ("z", lfalse) ])
+            | PATT p ->
+                let tag =
+                  match p with
+                  | Array -> array_tag
+                  | String -> string_tag
+                  | Sexp -> sexp_tag
+                  | Closure -> closure_tag
+                  | _ ->
                       failwith
-                        (Printf.sprintf "Unexpected pattern: StrCmp %s: %d"
-                           __FILE__ __LINE__))
-                  1 false
+                        (Printf.sprintf "Unexpected pattern: %s: %d" __FILE__
+                           __LINE__)
+                in
+                patt env (fun lfalse ->
+                    boxed lfalse
+                    @ [
+                        Mov (I (-2 * word_size, eax), eax);
+                        Binop ("&&", L 7, eax);
+                        Binop ("cmp", L tag, eax);
+                        CJmp ("ne", lfalse);
+                      ])
             | LINE line -> env#gen_line line
             | FAIL ((line, col), value) ->
                 let v, env = if value then (env#peek, env) else env#pop in
                 let s, env = env#string cmd#get_infile in
+                let sm, env = env#stack_map 4 in
                 ( env,
                   [
                     Push (L (box col));
@@ -665,6 +1276,7 @@ let compile cmd env imports code =
                     Push (M ("$" ^ s));
                     Push v;
                     Call "Bmatch_failure";
+                    Label sm;
                     Binop ("+", L (4 * word_size), esp);
                   ] )
             | i ->
@@ -684,11 +1296,29 @@ module S = Set.Make (String)
 (* A map indexed by strings *)
 module M = Map.Make (String)
 
+(* escapes a string literal for the assembler *)
+let escape x =
+  let n = String.length x in
+  let buf = Buffer.create (n * 2) in
+  let rec iterate i =
+    if i < n then (
+      (match x.[i] with
+      | '"' -> Buffer.add_string buf "\\\""
+      | '\n' -> Buffer.add_string buf "\n"
+      | '\t' -> Buffer.add_string buf "\t"
+      | c -> Buffer.add_char buf c);
+      iterate (i + 1))
+  in
+  iterate 0;
+  Buffer.contents buf
+
 (* Environment implementation *)
 class env prg =
   let chars =
     "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789'"
   in
+  let allocation, spills = allocate_registers prg in
+  let observed = observed_locals prg in
   (* let make_assoc l i =
        List.combine l (List.init (List.length l) (fun x -> x + i))
      in *)
@@ -701,6 +1331,8 @@ class env prg =
     val globals = S.empty (* a set of global variables         *)
     val stringm = M.empty (* a string map                      *)
     val scount = 0 (* string count                      *)
+    val staticm = M.empty (* a static object map               *)
+    val statics = [] (* static objects                    *)
     val stack_slots = 0 (* maximal number of stack positions *)
     val static_size = 0 (* static data size                  *)
     val stack = [] (* symbolic stack                    *)
@@ -708,6 +1340,7 @@ class env prg =
     val locals = [] (* function local variables          *)
     val fname = "" (* function name                     *)
     val stackmap = M.empty (* labels to stack map               *)
+    val gc_maps = [] (* GC stack maps of call sites       *)
     val barrier = false (* barrier condition                 *)
     val max_locals_size = 0
     val has_closure = false
@@ -715,6 +1348,9 @@ class env prg =
     val externs = S.empty
     val nlabels = 0
     val first_line = true
+    val insn = -1 (* current stack machine instruction *)
+    val allocs = 0 (* allocations in the current instruction *)
+    val spill_top = 0 (* first frame slot free of spills *)
     method publics = S.elements publics
     method register_public name = {<publics = S.add name publics>}
     method register_extern name = {<externs = S.add name externs>}
@@ -780,18 +1416,30 @@ class env prg =
       | Value.Arg i -> S (-(i + if has_closure then 2 else 1))
       | Value.Access i -> I (word_size * (i + 1), edx)
 
-    (* allocates a fresh position on a symbolic stack *)
+    (* moves to the next stack machine instruction *)
+    method next_insn = {<insn = insn + 1; allocs = 0>}
+
+    (* allocates a fresh position on a symbolic stack at the location given by
+       the register allocation; a position unknown to it gets a fresh frame slot *)
     method allocate =
-      let x, n =
-        let allocate' = function
-          | [] -> (ebx, 0)
-          | S n :: _ -> (S (n + 1), n + 2)
-          | R n :: _ when n < num_of_regs -> (R (n + 1), stack_slots)
-          | _ -> (S static_size, static_size + 1)
-        in
-        allocate' stack
+      let x, spill_top =
+        match Hashtbl.find_opt allocation (insn, allocs) with
+        | Some (x, depth) ->
+            if depth <> List.length stack || List.mem x stack then
+              failwith
+                (Printf.sprintf
+                   "register allocation does not match the code of %s at \
+                    instruction %d"
+                   fname insn);
+            (x, spill_top)
+        | None -> (S spill_top, spill_top + 1)
       in
-      (x, {<stack_slots = max n stack_slots; stack = x :: stack>})
+      let n = match x with S n -> n + 1 | _ -> stack_slots in
+      ( x,
+        {<stack_slots = max n stack_slots
+         ; stack = x :: stack
+         ; allocs = allocs + 1
+         ; spill_top>} )
 
     (* pushes an operand to the symbolic stack *)
     method push y = {<stack = y :: stack>}
@@ -814,6 +1462,9 @@ class env prg =
       let[@ocaml.warning "-8"] (x :: y :: _) = stack in
       (x, y)
 
+    (* peeks n topmost values from the stack, the topmost one is the last *)
+    method peekn n = List.rev (List.filteri (fun i _ -> i < n) stack)
+
     (* tag hash: gets a hash for a string tag *)
     method hash tag =
       let h = Stdlib.ref 0 in
@@ -830,21 +1481,6 @@ class env prg =
 
     (* registers a string constant *)
     method string x =
-      let escape x =
-        let n = String.length x in
-        let buf = Buffer.create (n * 2) in
-        let rec iterate i =
-          if i < n then (
-            (match x.[i] with
-            | '"' -> Buffer.add_string buf "\\\""
-            | '\n' -> Buffer.add_string buf "\n"
-            | '\t' -> Buffer.add_string buf "\t"
-            | c -> Buffer.add_char buf c);
-            iterate (i + 1))
-        in
-        iterate 0;
-        Buffer.contents buf
-      in
       let x = escape x in
       try (M.find x stringm, self)
       with Not_found ->
@@ -861,6 +1497,50 @@ class env prg =
     (* gets all string definitions *)
     method strings = M.bindings stringm
 
+    (* registers a preformatted immortal object (see `GC static objects` in
+       runtime/gc.h) given by its header and contents directives; returns the
+       label of its contents *)
+    method static_object key header contents =
+      try (M.find key staticm, self)
+      with Not_found ->
+        let y = Printf.sprintf "static_%d" (M.cardinal staticm) in
+        ( y,
+          {<staticm = M.add key y staticm
+           ; statics = (y, header, contents) :: statics>} )
+
+    (* registers a string literal which is only read as a static object; the
+       length is computed by the assembler since the literal may have escapes *)
+    method static_string x =
+      let x = escape x in
+      let y = Printf.sprintf "static_%d" (M.cardinal staticm) in
+      self#static_object ("string " ^ x) (y ^ "_header")
+        [
+          Printf.sprintf ".string\t\"%s\"" x;
+          Printf.sprintf ".set\t%s_header,\t1 | ((. - %s - 1) << 3)" y y;
+        ]
+
+    (* gets all static objects *)
+    method statics = List.rev statics
+
+    (* registers a GC stack map for a call site which has pushed the given number
+       of words; returns a label to put right after the call instruction *)
+    method stack_map pushed =
+      let lab = Printf.sprintf ".Lsm%d" nlabels in
+      let live =
+        List.init static_size (fun i -> i)
+        @ List.filter_map (function S i -> Some i | _ -> None) stack
+      in
+      ( lab,
+        {<nlabels = nlabels + 1
+         ; gc_maps = (lab, has_closure, pushed, live) :: gc_maps>} )
+
+    (* gets a fresh local label *)
+    method fresh_label =
+      (Printf.sprintf ".La%d" nlabels, {<nlabels = nlabels + 1>})
+
+    (* gets all GC stack maps *)
+    method stack_maps = List.rev gc_maps
+
     (* gets a number of stack positions allocated *)
     method allocated = stack_slots
     method allocated_size = Printf.sprintf "LS%s_SIZE" fname
@@ -870,11 +1550,18 @@ class env prg =
       {<nargs
        ; static_size = nlocals
        ; stack_slots = nlocals
+       ; spill_top =
+           nlocals
+           + Option.value (Hashtbl.find_opt spills insn) ~default:0
        ; stack = []
        ; fname = f
        ; has_closure
        ; first_line = true>}
 
+    (* gets the locals the prologue of the current function initialises *)
+    method observed_locals =
+      Option.value (Hashtbl.find_opt observed insn) ~default:[]
+
     (* returns a label for the epilogue *)
     method epilogue = Printf.sprintf "L%s_epilogue" fname
 
@@ -938,6 +1625,45 @@ let genasm cmd prog =
              Meta (Printf.sprintf "%s:\t.int\t1" s);
            ])
          env#globals
+    @ [ Meta "\t.section lama_statics,\"a\",@progbits" ]
+    @ List.concat_map
+        (fun (y, header, contents) ->
+          [
+            Meta "\t.balign\t4";
+            Meta (Printf.sprintf "\t.int\t%s, 0" header);
+            Label y;
+          ]
+          @ List.map (fun d -> Meta ("\t" ^ d)) contents)
+        env#statics
+  in
+  let stack_maps =
+    let bitmap live =
+      let words = Array.make ((List.fold_left max (-1) live + 32) / 32) 0 in
+      List.iter
+        (fun i -> words.(i / 32) <- words.(i / 32) lor (1 lsl (i mod 32)))
+        live;
+      Array.to_list words
+    in
+    let maps = env#stack_maps in
+    [ Meta "\t.section lama_stackmaps,\"a\",@progbits" ]
+    @ List.map
+        (fun (lab, has_closure, pushed, live) ->
+          Meta
+            (Printf.sprintf "\t.int\t%s, %d, %d, %d, %s_live" lab
+               (if has_closure then 1 else 0)
+               pushed
+               (List.length (bitmap live))
+               lab))
+        maps
+    @ [ Meta "\t.section .rodata" ]
+    @ List.map
+        (fun (lab, _, _, live) ->
+          Meta
+            (Printf.sprintf "%s_live:\t.int\t%s" lab
+               (String.concat ", "
+                  (List.map string_of_int
+                     (match bitmap live with [] -> [ 0 ] | words -> words)))))
+        maps
   in
   let asm = Buffer.create 1024 in
   List.iter
@@ -954,7 +1680,7 @@ let genasm cmd prog =
         Label ".Ltext";
         Meta "\t.stabs \"data:t1=r1;0;4294967295;\",128,0,0,0";
       ]
-    @ code);
+    @ code @ stack_maps);
   Buffer.contents asm
 
 let get_std_path () =
@@ -985,7 +1711,7 @@ let build cmd prog =
   cmd#dump_file "i" (Interface.gen prog);
   let inc = get_std_path () in
   let compiler = "gcc" in
-  let flags = "-no-pie -m32" in
+  let flags = "-no-pie -m32 -pthread" in
   match cmd#get_mode with
   | `Default ->
       let objs = find_objects (fst @@ fst prog) cmd#get_include_paths in